@@ -23,15 +23,92 @@ BEGIN_RCPP
 END_RCPP
 }
 // sampling_cpp
-Rcpp::List sampling_cpp(const Rcpp::List& ngme_block, int iterations, bool posterior);
-RcppExport SEXP _ngme2_sampling_cpp(SEXP ngme_blockSEXP, SEXP iterationsSEXP, SEXP posteriorSEXP) {
+Rcpp::List sampling_cpp(const Rcpp::List& ngme_block, int iterations, bool posterior, const Rcpp::List& control_sampling);
+RcppExport SEXP _ngme2_sampling_cpp(SEXP ngme_blockSEXP, SEXP iterationsSEXP, SEXP posteriorSEXP, SEXP control_samplingSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
     Rcpp::traits::input_parameter< int >::type iterations(iterationsSEXP);
     Rcpp::traits::input_parameter< bool >::type posterior(posteriorSEXP);
-    rcpp_result_gen = Rcpp::wrap(sampling_cpp(ngme_block, iterations, posterior));
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type control_sampling(control_samplingSEXP);
+    rcpp_result_gen = Rcpp::wrap(sampling_cpp(ngme_block, iterations, posterior, control_sampling));
+    return rcpp_result_gen;
+END_RCPP
+}
+// predict_cpp
+Rcpp::List predict_cpp(const Rcpp::List& ngme_block, const Eigen::SparseMatrix<double>& A_pred, const Eigen::MatrixXd& X_pred, const Rcpp::List& control_predict);
+RcppExport SEXP _ngme2_predict_cpp(SEXP ngme_blockSEXP, SEXP A_predSEXP, SEXP X_predSEXP, SEXP control_predictSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    Rcpp::traits::input_parameter< const Eigen::SparseMatrix<double>& >::type A_pred(A_predSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd& >::type X_pred(X_predSEXP);
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type control_predict(control_predictSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_cpp(ngme_block, A_pred, X_pred, control_predict));
+    return rcpp_result_gen;
+END_RCPP
+}
+// post_var_cpp
+Rcpp::List post_var_cpp(const Rcpp::List& ngme_block, const Eigen::SparseMatrix<double>& A_pred, int batch_size);
+RcppExport SEXP _ngme2_post_var_cpp(SEXP ngme_blockSEXP, SEXP A_predSEXP, SEXP batch_sizeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    Rcpp::traits::input_parameter< const Eigen::SparseMatrix<double>& >::type A_pred(A_predSEXP);
+    Rcpp::traits::input_parameter< int >::type batch_size(batch_sizeSEXP);
+    rcpp_result_gen = Rcpp::wrap(post_var_cpp(ngme_block, A_pred, batch_size));
+    return rcpp_result_gen;
+END_RCPP
+}
+// save_model_cpp
+void save_model_cpp(const Rcpp::List& ngme_block, std::string file);
+RcppExport SEXP _ngme2_save_model_cpp(SEXP ngme_blockSEXP, SEXP fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    save_model_cpp(ngme_block, file);
+    return R_NilValue;
+END_RCPP
+}
+// predict_file_cpp
+Rcpp::List predict_file_cpp(std::string file, const Eigen::SparseMatrix<double>& A_pred, const Eigen::MatrixXd& X_pred, int batch_size);
+RcppExport SEXP _ngme2_predict_file_cpp(SEXP fileSEXP, SEXP A_predSEXP, SEXP X_predSEXP, SEXP batch_sizeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< const Eigen::SparseMatrix<double>& >::type A_pred(A_predSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd& >::type X_pred(X_predSEXP);
+    Rcpp::traits::input_parameter< int >::type batch_size(batch_sizeSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_file_cpp(file, A_pred, X_pred, batch_size));
+    return rcpp_result_gen;
+END_RCPP
+}
+// post_var_file_cpp
+Rcpp::List post_var_file_cpp(std::string file, const Eigen::SparseMatrix<double>& A_pred, int batch_size);
+RcppExport SEXP _ngme2_post_var_file_cpp(SEXP fileSEXP, SEXP A_predSEXP, SEXP batch_sizeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< const Eigen::SparseMatrix<double>& >::type A_pred(A_predSEXP);
+    Rcpp::traits::input_parameter< int >::type batch_size(batch_sizeSEXP);
+    rcpp_result_gen = Rcpp::wrap(post_var_file_cpp(file, A_pred, batch_size));
+    return rcpp_result_gen;
+END_RCPP
+}
+// load_model_cpp
+Rcpp::List load_model_cpp(std::string file);
+RcppExport SEXP _ngme2_load_model_cpp(SEXP fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(load_model_cpp(file));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -49,11 +126,220 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// pcg_solve_cpp
+Rcpp::List pcg_solve_cpp(Eigen::SparseMatrix<double> Q, const Eigen::MatrixXd& B, int max_iter, double tol);
+RcppExport SEXP _ngme2_pcg_solve_cpp(SEXP QSEXP, SEXP BSEXP, SEXP max_iterSEXP, SEXP tolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::SparseMatrix<double> >::type Q(QSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd& >::type B(BSEXP);
+    Rcpp::traits::input_parameter< int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    rcpp_result_gen = Rcpp::wrap(pcg_solve_cpp(Q, B, max_iter, tol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// hutchinson_trace_cpp
+double hutchinson_trace_cpp(Eigen::SparseMatrix<double> Q, Eigen::SparseMatrix<double> M, int n_probes, int max_iter, double tol);
+RcppExport SEXP _ngme2_hutchinson_trace_cpp(SEXP QSEXP, SEXP MSEXP, SEXP n_probesSEXP, SEXP max_iterSEXP, SEXP tolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::SparseMatrix<double> >::type Q(QSEXP);
+    Rcpp::traits::input_parameter< Eigen::SparseMatrix<double> >::type M(MSEXP);
+    Rcpp::traits::input_parameter< int >::type n_probes(n_probesSEXP);
+    Rcpp::traits::input_parameter< int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    rcpp_result_gen = Rcpp::wrap(hutchinson_trace_cpp(Q, M, n_probes, max_iter, tol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// slq_logdet_cpp
+double slq_logdet_cpp(Eigen::SparseMatrix<double> Q, int n_probes, int depth, unsigned long seed);
+RcppExport SEXP _ngme2_slq_logdet_cpp(SEXP QSEXP, SEXP n_probesSEXP, SEXP depthSEXP, SEXP seedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::SparseMatrix<double> >::type Q(QSEXP);
+    Rcpp::traits::input_parameter< int >::type n_probes(n_probesSEXP);
+    Rcpp::traits::input_parameter< int >::type depth(depthSEXP);
+    Rcpp::traits::input_parameter< unsigned long >::type seed(seedSEXP);
+    rcpp_result_gen = Rcpp::wrap(slq_logdet_cpp(Q, n_probes, depth, seed));
+    return rcpp_result_gen;
+END_RCPP
+}
+// grad_theta_K_cpp
+Rcpp::List grad_theta_K_cpp(Rcpp::List model_list, double eps);
+RcppExport SEXP _ngme2_grad_theta_K_cpp(SEXP model_listSEXP, SEXP epsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type model_list(model_listSEXP);
+    Rcpp::traits::input_parameter< double >::type eps(epsSEXP);
+    rcpp_result_gen = Rcpp::wrap(grad_theta_K_cpp(model_list, eps));
+    return rcpp_result_gen;
+END_RCPP
+}
+// get_dK_cpp
+Rcpp::List get_dK_cpp(Rcpp::List model_list, double eps);
+RcppExport SEXP _ngme2_get_dK_cpp(SEXP model_listSEXP, SEXP epsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type model_list(model_listSEXP);
+    Rcpp::traits::input_parameter< double >::type eps(epsSEXP);
+    rcpp_result_gen = Rcpp::wrap(get_dK_cpp(model_list, eps));
+    return rcpp_result_gen;
+END_RCPP
+}
+// posterior_summary_cpp
+Rcpp::List posterior_summary_cpp(const Eigen::MatrixXd& draws, const Eigen::VectorXd& probs, const Eigen::VectorXd& thresholds, int n_chains);
+RcppExport SEXP _ngme2_posterior_summary_cpp(SEXP drawsSEXP, SEXP probsSEXP, SEXP thresholdsSEXP, SEXP n_chainsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd& >::type draws(drawsSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type probs(probsSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type thresholds(thresholdsSEXP);
+    Rcpp::traits::input_parameter< int >::type n_chains(n_chainsSEXP);
+    rcpp_result_gen = Rcpp::wrap(posterior_summary_cpp(draws, probs, thresholds, n_chains));
+    return rcpp_result_gen;
+END_RCPP
+}
+// grad_beta_cpp
+Rcpp::List grad_beta_cpp(const Rcpp::List& ngme_block);
+RcppExport SEXP _ngme2_grad_beta_cpp(SEXP ngme_blockSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    rcpp_result_gen = Rcpp::wrap(grad_beta_cpp(ngme_block));
+    return rcpp_result_gen;
+END_RCPP
+}
+// latent_kernels_cpp
+Rcpp::List latent_kernels_cpp(Rcpp::List model_list, const Eigen::MatrixXd& B);
+RcppExport SEXP _ngme2_latent_kernels_cpp(SEXP model_listSEXP, SEXP BSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type model_list(model_listSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd& >::type B(BSEXP);
+    rcpp_result_gen = Rcpp::wrap(latent_kernels_cpp(model_list, B));
+    return rcpp_result_gen;
+END_RCPP
+}
+// lattice_eigen_cpp
+Rcpp::List lattice_eigen_cpp(Rcpp::List model_list);
+RcppExport SEXP _ngme2_lattice_eigen_cpp(SEXP model_listSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type model_list(model_listSEXP);
+    rcpp_result_gen = Rcpp::wrap(lattice_eigen_cpp(model_list));
+    return rcpp_result_gen;
+END_RCPP
+}
+// ell_matrix_cpp
+Rcpp::List ell_matrix_cpp(const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& x, const Eigen::VectorXd& y, const Eigen::VectorXd& w);
+RcppExport SEXP _ngme2_ell_matrix_cpp(SEXP ASEXP, SEXP xSEXP, SEXP ySEXP, SEXP wSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Eigen::SparseMatrix<double>& >::type A(ASEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type y(ySEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type w(wSEXP);
+    rcpp_result_gen = Rcpp::wrap(ell_matrix_cpp(A, x, y, w));
+    return rcpp_result_gen;
+END_RCPP
+}
+// component_mean_cpp
+Rcpp::List component_mean_cpp(const Rcpp::List& ngme_block);
+RcppExport SEXP _ngme2_component_mean_cpp(SEXP ngme_blockSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    rcpp_result_gen = Rcpp::wrap(component_mean_cpp(ngme_block));
+    return rcpp_result_gen;
+END_RCPP
+}
+// block_grad_cpp
+Eigen::VectorXd block_grad_cpp(const Rcpp::List& ngme_block);
+RcppExport SEXP _ngme2_block_grad_cpp(SEXP ngme_blockSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    rcpp_result_gen = Rcpp::wrap(block_grad_cpp(ngme_block));
+    return rcpp_result_gen;
+END_RCPP
+}
+// joint_mean_cpp
+Rcpp::List joint_mean_cpp(const Rcpp::List& ngme_block);
+RcppExport SEXP _ngme2_joint_mean_cpp(SEXP ngme_blockSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Rcpp::List& >::type ngme_block(ngme_blockSEXP);
+    rcpp_result_gen = Rcpp::wrap(joint_mean_cpp(ngme_block));
+    return rcpp_result_gen;
+END_RCPP
+}
+// gig_moments_cpp
+Rcpp::List gig_moments_cpp(const Eigen::VectorXd& p, const Eigen::VectorXd& a, const Eigen::VectorXd& b);
+RcppExport SEXP _ngme2_gig_moments_cpp(SEXP pSEXP, SEXP aSEXP, SEXP bSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type p(pSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type a(aSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type b(bSEXP);
+    rcpp_result_gen = Rcpp::wrap(gig_moments_cpp(p, a, b));
+    return rcpp_result_gen;
+END_RCPP
+}
+// basis_cpp
+Rcpp::List basis_cpp(const Eigen::MatrixXd& B, const Eigen::VectorXd& theta, const Eigen::VectorXd& v);
+RcppExport SEXP _ngme2_basis_cpp(SEXP BSEXP, SEXP thetaSEXP, SEXP vSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd& >::type B(BSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type theta(thetaSEXP);
+    Rcpp::traits::input_parameter< const Eigen::VectorXd& >::type v(vSEXP);
+    rcpp_result_gen = Rcpp::wrap(basis_cpp(B, theta, v));
+    return rcpp_result_gen;
+END_RCPP
+}
 
 static const R_CallMethodDef CallEntries[] = {
     {"_ngme2_estimate_cpp", (DL_FUNC) &_ngme2_estimate_cpp, 1},
-    {"_ngme2_sampling_cpp", (DL_FUNC) &_ngme2_sampling_cpp, 3},
+    {"_ngme2_sampling_cpp", (DL_FUNC) &_ngme2_sampling_cpp, 4},
+    {"_ngme2_predict_cpp", (DL_FUNC) &_ngme2_predict_cpp, 4},
+    {"_ngme2_post_var_cpp", (DL_FUNC) &_ngme2_post_var_cpp, 3},
+    {"_ngme2_save_model_cpp", (DL_FUNC) &_ngme2_save_model_cpp, 2},
+    {"_ngme2_predict_file_cpp", (DL_FUNC) &_ngme2_predict_file_cpp, 4},
+    {"_ngme2_post_var_file_cpp", (DL_FUNC) &_ngme2_post_var_file_cpp, 3},
+    {"_ngme2_load_model_cpp", (DL_FUNC) &_ngme2_load_model_cpp, 1},
     {"_ngme2_rGIG_cpp", (DL_FUNC) &_ngme2_rGIG_cpp, 4},
+    {"_ngme2_pcg_solve_cpp", (DL_FUNC) &_ngme2_pcg_solve_cpp, 4},
+    {"_ngme2_hutchinson_trace_cpp", (DL_FUNC) &_ngme2_hutchinson_trace_cpp, 5},
+    {"_ngme2_slq_logdet_cpp", (DL_FUNC) &_ngme2_slq_logdet_cpp, 4},
+    {"_ngme2_grad_theta_K_cpp", (DL_FUNC) &_ngme2_grad_theta_K_cpp, 2},
+    {"_ngme2_get_dK_cpp", (DL_FUNC) &_ngme2_get_dK_cpp, 2},
+    {"_ngme2_posterior_summary_cpp", (DL_FUNC) &_ngme2_posterior_summary_cpp, 4},
+    {"_ngme2_grad_beta_cpp", (DL_FUNC) &_ngme2_grad_beta_cpp, 1},
+    {"_ngme2_latent_kernels_cpp", (DL_FUNC) &_ngme2_latent_kernels_cpp, 2},
+    {"_ngme2_lattice_eigen_cpp", (DL_FUNC) &_ngme2_lattice_eigen_cpp, 1},
+    {"_ngme2_ell_matrix_cpp", (DL_FUNC) &_ngme2_ell_matrix_cpp, 4},
+    {"_ngme2_component_mean_cpp", (DL_FUNC) &_ngme2_component_mean_cpp, 1},
+    {"_ngme2_block_grad_cpp", (DL_FUNC) &_ngme2_block_grad_cpp, 1},
+    {"_ngme2_joint_mean_cpp", (DL_FUNC) &_ngme2_joint_mean_cpp, 1},
+    {"_ngme2_gig_moments_cpp", (DL_FUNC) &_ngme2_gig_moments_cpp, 3},
+    {"_ngme2_basis_cpp", (DL_FUNC) &_ngme2_basis_cpp, 3},
     {NULL, NULL, 0}
 };
 
@@ -1,6 +1,8 @@
 #include "block.h"
 #include <random>
 #include <cmath>
+#include <fstream>
+#include <algorithm>
 
 using std::pow;
 
@@ -9,7 +11,6 @@ BlockModel::BlockModel(
   unsigned long seed
 ) :
   rng               (seed),
-  X                 (Rcpp::as<MatrixXd>      (block_model["X"])),
   Y                 (Rcpp::as<VectorXd>      (block_model["Y"])),
   W_sizes           (Rcpp::as<int>           (block_model["W_sizes"])),
   V_sizes           (Rcpp::as<int>           (block_model["V_sizes"])),
@@ -26,11 +27,18 @@ BlockModel::BlockModel(
   var               (Var(Rcpp::as<Rcpp::List> (block_model["noise"]), rng())),
 
   curr_iter         (0),
-  beta_traj         (beta.size()),
   // dK            (V_sizes, W_sizes)
   // d2K           (V_sizes, W_sizes)
   par_string        (Rcpp::as<string>     (block_model["par_string"]))
 {
+  // dense or sparse X (dgCMatrix)
+  SEXP X_in = block_model["X"];
+  sparse_X = Rf_inherits(X_in, "dgCMatrix");
+  if (sparse_X)
+    X_sp = Rcpp::as<SparseMatrix<double>> (X_in);
+  else
+    X = Rcpp::as<MatrixXd> (X_in);
+
   // 1. Init controls
   Rcpp::List control_in = block_model["control"];
     const int burnin = control_in["burnin"];
@@ -40,37 +48,46 @@ BlockModel::BlockModel(
     reduce_var    =  Rcpp::as<bool>   (control_in["reduce_var"]);
     reduce_power  =  Rcpp::as<double> (control_in["reduce_power"]);
     threshold   =  Rcpp::as<double> (control_in["threshold"]);
+    rao_blackwell = Rcpp::as<bool>  (control_in["rao_blackwell"]);
+    exact_gaussian = Rcpp::as<bool> (control_in["exact_gaussian"]);
+    joint_beta  =  Rcpp::as<bool>   (control_in["joint_beta"]);
+
+    // trajectories: one record per iteration (+ the initial one)
+    const int iterations = control_in["iterations"];
+    const int traj_thin   = Rcpp::as<int>  (control_in["traj_thin"]);
+    const bool traj_single = Rcpp::as<bool> (control_in["traj_single"]);
+    string traj_file = Rf_isNull(control_in["traj_file"]) ? "" : Rcpp::as<string> (control_in["traj_file"]);
+
+    // resuming from a checkpoint: the streamed trajectories are continued, not truncated
+    string ckpt_file = Rf_isNull(control_in["checkpoint_file"]) ? "" : Rcpp::as<string> (control_in["checkpoint_file"]);
+    const bool resuming = Rcpp::as<bool> (control_in["resume"]) && !ckpt_file.empty()
+      && std::ifstream(ckpt_file).good();
 
 if (debug) Rcpp::Rcout << "Begin Block Constructor" << std::endl;
 
   // 2. Init Fixed effects
   fix_flag[block_fix_beta]   = Rcpp::as<bool>        (control_in["fix_beta"]);
   if (beta.size() == 0) opt_beta = false;
+  beta_post = beta;
 
   // 3. Init latent models
   Rcpp::List latents_in = block_model["latents"];
   n_latent = latents_in.size(); // how many latent model
   for (int i=0; i < n_latent; ++i) {
     Rcpp::List latent_in = Rcpp::as<Rcpp::List> (latents_in[i]);
-    int n_theta_K = Rcpp::as<int> (latent_in["n_theta_K"]);
 
     // construct acoording to models
     unsigned long latent_seed = rng();
-    string model_type = latent_in["model"];
-    if (model_type == "ar1") {
-      latents.push_back(std::make_unique<AR>(latent_in, latent_seed));
-    }
-    else if (model_type == "rw1") {
-      latents.push_back(std::make_unique<AR>(latent_in, latent_seed));
-    }
-    else if (model_type == "matern" && n_theta_K > 1) {
-      latents.push_back(std::make_unique<Matern_ns>(latent_in, latent_seed));
-    } else if (model_type=="matern" && n_theta_K == 1) {
-      latents.push_back(std::make_unique<Matern>(latent_in, latent_seed));
-    } else {
-      Rcpp::Rcout << "Unknown model." << std::endl;
-    }
+    std::unique_ptr<Latent> latent = create_latent(latent_in, latent_seed);
+    if (!latent)
+      Rcpp::stop("Unknown model: " + Rcpp::as<string> (latent_in["model"]));
+    latents.push_back(std::move(latent));
+    latents.back()->set_rao_blackwell(rao_blackwell);
+    latents.back()->init_traj(iterations + 1, traj_thin, traj_single,
+      traj_file.empty() ? "" : traj_file + "_" + std::to_string(seed) + "_latent" + std::to_string(i + 1) + ".bin",
+      resuming);
   }
+  n_latent = latents.size();
 
   /* Init variables: h, A */
   int n = 0;
@@ -80,16 +97,31 @@ if (debug) Rcpp::Rcout << "Begin Block Constructor" << std::endl;
   }
   assemble();
 
+  // per-latent solves if some latent has a structured solve (replicates, Kronecker) and all are square
+  latent_solve = false;
+  bool all_square = true;
+  for (std::vector<std::unique_ptr<Latent>>::iterator it = latents.begin(); it != latents.end(); it++) {
+    if ((*it)->has_solve_K()) latent_solve = true;
+    if ((*it)->get_W_size() != (*it)->get_V_size()) all_square = false;
+  }
+  latent_solve = latent_solve && all_square;
+
+  // fast path for A with at most 4 entries per row
+  if (n_latent > 0) {
+    structured_A = A_ell.compress(A);
+    if (structured_A) A_ell.gram_pattern(AtDA_pattern);
+  }
+
 if (debug) Rcpp::Rcout << "After block assemble" << std::endl;
 
   // 4. Init measurement noise
   Rcpp::List noise_in   = block_model["noise"];
 
-  B_mu          = (Rcpp::as<MatrixXd>      (noise_in["B_mu"])),
+  B_mu.set        (Rcpp::as<MatrixXd>      (noise_in["B_mu"])),
   theta_mu      = (Rcpp::as<VectorXd>      (noise_in["theta_mu"])),
   n_theta_mu    = (theta_mu.size()),
 
-  B_sigma       = (Rcpp::as<MatrixXd>      (noise_in["B_sigma"])),
+  B_sigma.set     (Rcpp::as<MatrixXd>      (noise_in["B_sigma"])),
   theta_sigma   = (Rcpp::as<VectorXd>      (noise_in["theta_sigma"])),
   n_theta_sigma = (theta_sigma.size()),
 
@@ -97,8 +129,21 @@ if (debug) Rcpp::Rcout << "After block assemble" << std::endl;
   fix_flag[block_fix_theta_sigma]     = Rcpp::as<bool> (noise_in["fix_theta_sigma"]);
 
   family = Rcpp::as<string>  (noise_in["noise_type"]);
-  noise_mu = B_mu * theta_mu;
-  noise_sigma = (B_sigma * theta_sigma).array().exp();
+  family_type = to_noise_type(family);
+  var.set_rao_blackwell(rao_blackwell);
+
+  // exact mode only if V is constant everywhere
+  if (exact_gaussian) {
+    bool all_normal = (family_type == noise_normal);
+    for (int i=0; i < n_latent; i++)
+      all_normal = all_normal && (latents[i]->get_noise_type_id() == noise_normal);
+    if (!all_normal) {
+      Rcpp::Rcout << "exact_gaussian is only available when all noises are normal, use Gibbs sampling instead." << std::endl;
+      exact_gaussian = false;
+    }
+  }
+  noise_mu = B_mu.times(theta_mu);
+  noise_sigma = (B_sigma.times(theta_sigma)).array().exp();
 
 if (debug) Rcpp::Rcout << "After block construct noise" << std::endl;
 
@@ -109,10 +154,21 @@ if (debug) Rcpp::Rcout << "After block construct noise" << std::endl;
   if(n_latent > 0){
     VectorXd inv_SV = VectorXd::Constant(V_sizes, 1).cwiseQuotient(getSV());
     SparseMatrix<double> Q = K.transpose() * inv_SV.asDiagonal() * K;
-    SparseMatrix<double> QQ = Q + A.transpose() * noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV()).asDiagonal() * A;
+    SparseMatrix<double> QQ = Q + obs_precision(noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV()));
     chol_Q.analyze(Q);
     chol_QQ.analyze(QQ);
     LU_K.analyzePattern(K);
+    init_components(QQ);
+
+    // exact mode already integrates W out analytically
+    if (joint_beta && (!opt_beta || exact_gaussian)) joint_beta = false;
+    if (joint_beta) {
+      VectorXd noise_inv_SV = noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV());
+      SparseMatrix<double> QQ_beta = joint_precision(inv_SV, noise_inv_SV);
+      chol_QQ_beta.analyze(QQ_beta);
+    }
+  } else {
+    joint_beta = false;
   }
 
 if (debug) Rcpp::Rcout << "After init solver" << std::endl;
@@ -129,8 +185,8 @@ if (debug) Rcpp::Rcout << "After init solver" << std::endl;
 if (debug) Rcpp::Rcout << "After Sample W" << std::endl;
 
   // record
-  theta_mu_traj.resize(n_theta_mu);
-  theta_sigma_traj.resize(n_theta_sigma);
+  traj.init(n_feff + n_theta_mu + n_theta_sigma + 1, iterations + 1, traj_thin, traj_single,
+    traj_file.empty() ? "" : traj_file + "_" + std::to_string(seed) + "_block.bin", resuming);
   record_traj();
 
 if (debug) Rcpp::Rcout << "End Block Constructor" << std::endl;
@@ -184,6 +240,10 @@ void BlockModel::sampleW_VY()
 {
 // if (debug) Rcpp::Rcout << "starting sampling W." << std::endl;
   if (n_latent==0) return;
+  if (joint_beta) {
+    sampleWbeta_VY();
+    return;
+  }
 
   VectorXd SV = getSV();
   VectorXd inv_SV = VectorXd::Constant(SV.size(), 1).cwiseQuotient(SV);
@@ -194,16 +254,21 @@ void BlockModel::sampleW_VY()
   // SparseMatrix<double> QQ = Q + pow(sigma_eps, -2) * A.transpose() * A;
   // SparseMatrix<double> QQ = Q + A.transpose() * noise_sigma.cwiseInverse().asDiagonal() * A;
   VectorXd noise_V = var.getV();
-  SparseMatrix<double> QQ = Q + A.transpose() * noise_sigma.array().pow(-2).matrix().cwiseQuotient(noise_V).asDiagonal() * A;
-  chol_QQ.compute(QQ);
+  SparseMatrix<double> QQ = Q + obs_precision(noise_sigma.array().pow(-2).matrix().cwiseQuotient(noise_V));
 
   // VectorXd M = K.transpose() * inv_SV.asDiagonal() * getMean() +
   //     pow(sigma_eps, -2) * A.transpose() * (Y - X * beta);
   VectorXd residual = get_residual();
   VectorXd M = K.transpose() * inv_SV.asDiagonal() * getMean() +
   // VectorXd M = K.transpose() * inv_V.asDiagonal() * getMean() +
-      A.transpose() * noise_sigma.array().pow(-2).matrix().cwiseQuotient(noise_V).asDiagonal() * (residual + A * getW());
+      At_times(noise_sigma.array().pow(-2).matrix().cwiseQuotient(noise_V).cwiseProduct(residual + A_times(getW())));
 
+  if (n_comp > 1) {
+    setW(sample_components(QQ, M));
+    return;
+  }
+
+  chol_QQ.compute(QQ);
   VectorXd z (W_sizes);
   z = rnorm_vec(W_sizes, 0, 1, rng());
   // sample W ~ N(QQ^-1*M, QQ^-1)
@@ -213,6 +278,187 @@ void BlockModel::sampleW_VY()
 // if (debug) Rcpp::Rcout << "Finish sampling W" << std::endl;
 }
 
+// find the connected components of QQ, analyze each diagonal block once
+void BlockModel::init_components(SparseMatrix<double>& QQ)
+{
+  VectorXi label;
+  n_comp = connected_components(QQ, label);
+  if (n_comp == 1) return;
+
+  comp_size.assign(n_comp, 0);
+  for (int i=0; i < W_sizes; i++) comp_size[label(i)]++;
+  comp_start.assign(n_comp, 0);
+  for (int c=1; c < n_comp; c++) comp_start[c] = comp_start[c-1] + comp_size[c-1];
+
+  // new position of index i, keeping the original order inside a component
+  std::vector<int> next = comp_start;
+  comp_perm.resize(W_sizes);
+  for (int i=0; i < W_sizes; i++) comp_perm.indices()(i) = next[label(i)]++;
+
+  SparseMatrix<double> QQp;
+  QQp = QQ.twistedBy(comp_perm);
+  chol_comps.clear();
+  comp_rngs.clear();
+  for (int c=0; c < n_comp; c++) {
+    SparseMatrix<double> Qc = QQp.block(comp_start[c], comp_start[c], comp_size[c], comp_size[c]);
+    chol_comps.push_back(std::make_unique<cholesky_solver>());
+    chol_comps.back()->init(comp_size[c], 0, 0, 0);
+    chol_comps.back()->analyze(Qc);
+    comp_rngs.push_back(std::mt19937(rng()));
+  }
+
+if (debug) Rcpp::Rcout << "QQ has " << n_comp << " independent components" << std::endl;
+}
+
+// W ~ N(QQ^-1 M, QQ^-1), factorizing and sampling the components in parallel (QQ^-1 M if !sample)
+VectorXd BlockModel::sample_components(SparseMatrix<double>& QQ, const VectorXd& M, bool sample)
+{
+  SparseMatrix<double> QQp;
+  QQp = QQ.twistedBy(comp_perm);
+  VectorXd Mp = comp_perm * M;
+  VectorXd Wp (W_sizes);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int c=0; c < n_comp; c++) {
+    SparseMatrix<double> Qc = QQp.block(comp_start[c], comp_start[c], comp_size[c], comp_size[c]);
+    VectorXd Mc = Mp.segment(comp_start[c], comp_size[c]);
+    chol_comps[c]->compute(Qc);
+    if (sample) {
+      VectorXd z = rnorm_vec(comp_size[c], 0, 1, comp_rngs[c]());
+      Wp.segment(comp_start[c], comp_size[c]) = chol_comps[c]->rMVN(Mc, z);
+    } else {
+      Wp.segment(comp_start[c], comp_size[c]) = chol_comps[c]->solve(Mc);
+    }
+  }
+
+  return comp_perm.inverse() * Wp;
+}
+
+/*
+  precision of [W; beta] | V, Y (flat prior on beta)
+    [ QQ         A^T D X ]
+    [ X^T D A    X^T D X ]
+  D = diag(noise_inv_SV)
+*/
+SparseMatrix<double> BlockModel::joint_precision(const VectorXd& inv_SV, const VectorXd& noise_inv_SV) const
+{
+  SparseMatrix<double> QQ = K.transpose() * inv_SV.asDiagonal() * K
+    + obs_precision(noise_inv_SV);
+  MatrixXd AtDX = sparse_X
+    ? MatrixXd(A.transpose() * noise_inv_SV.asDiagonal() * X_sp)
+    : MatrixXd(A.transpose() * (noise_inv_SV.asDiagonal() * X));
+  MatrixXd XtDX_joint;
+  X_gram(noise_inv_SV, XtDX_joint);
+
+  std::vector<Triplet<double>> triplets;
+  triplets.reserve(QQ.nonZeros() + 2 * AtDX.size() + XtDX_joint.size());
+  for (int k=0; k < QQ.outerSize(); ++k)
+    for (SparseMatrix<double>::InnerIterator it(QQ, k); it; ++it)
+      triplets.push_back(Triplet<double>(it.row(), it.col(), it.value()));
+  for (int j=0; j < n_feff; j++) {
+    for (int i=0; i < W_sizes; i++) {
+      triplets.push_back(Triplet<double>(i, W_sizes + j, AtDX(i, j)));
+      triplets.push_back(Triplet<double>(W_sizes + j, i, AtDX(i, j)));
+    }
+    for (int i=0; i < n_feff; i++)
+      triplets.push_back(Triplet<double>(W_sizes + i, W_sizes + j, XtDX_joint(i, j)));
+  }
+
+  SparseMatrix<double> QQ_beta (W_sizes + n_feff, W_sizes + n_feff);
+  QQ_beta.setFromTriplets(triplets.begin(), triplets.end());
+  return QQ_beta;
+}
+
+// chol_QQ_beta <- precision of [W; beta] | V, Y, returns M such that the mean is QQ_beta^-1 M
+VectorXd BlockModel::factorize_QQ_beta()
+{
+  VectorXd inv_SV = VectorXd::Constant(V_sizes, 1).cwiseQuotient(getSV());
+  VectorXd noise_inv_SV = noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV());
+  SparseMatrix<double> QQ_beta = joint_precision(inv_SV, noise_inv_SV);
+  chol_QQ_beta.compute(QQ_beta);
+
+  // Y - mu(V-1)
+  VectorXd Y_tilde = get_residual() + A_times(getW()) + X_times(beta);
+  VectorXd DY = noise_inv_SV.cwiseProduct(Y_tilde);
+  VectorXd M (W_sizes + n_feff);
+  M.head(W_sizes) = K.transpose() * inv_SV.asDiagonal() * getMean() + At_times(DY);
+  M.tail(n_feff) = Xt_times(DY);
+  return M;
+}
+
+// E[W; beta | V, Y]
+VectorXd BlockModel::cond_mean_Wbeta()
+{
+  VectorXd M = factorize_QQ_beta();
+  return chol_QQ_beta.solve(M);
+}
+
+// sample [W; beta] | V, Y with one factorization, keep the mean of beta for grad_beta
+void BlockModel::sampleWbeta_VY()
+{
+  VectorXd M = factorize_QQ_beta();
+
+  VectorXd z = rnorm_vec(W_sizes + n_feff, 0, 1, rng());
+  VectorXd Wbeta = chol_QQ_beta.rMVN(M, z);
+  beta_post = chol_QQ_beta.solve(M).tail(n_feff);
+  setW(Wbeta.head(W_sizes));
+}
+
+// QQ = K^T diag(1/SV) K + A^T diag(1/(sigma^2 V)) A at the current V
+SparseMatrix<double> BlockModel::cond_precision() const
+{
+  VectorXd inv_SV = VectorXd::Constant(V_sizes, 1).cwiseQuotient(getSV());
+  SparseMatrix<double> Q = K.transpose() * inv_SV.asDiagonal() * K;
+  return Q + obs_precision(noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV()));
+}
+
+// M = K^T diag(1/SV) mu(V-h) + A^T diag(1/(sigma^2 V)) (Y - X beta - mu(V-1)), E[W|V,Y] = QQ^-1 M
+VectorXd BlockModel::cond_rhs() const
+{
+  VectorXd inv_SV = VectorXd::Constant(V_sizes, 1).cwiseQuotient(getSV());
+  VectorXd residual = get_residual();
+  return K.transpose() * inv_SV.asDiagonal() * getMean() +
+      At_times(noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV()).cwiseProduct(residual + A_times(getW())));
+}
+
+// chol_QQ <- QQ at the current V
+void BlockModel::factorize_QQ()
+{
+  SparseMatrix<double> QQ = cond_precision();
+  chol_QQ.compute(QQ);
+}
+
+// E[W|V,Y] = QQ^-1 M, leaves the factorization of QQ in chol_QQ
+VectorXd BlockModel::cond_mean_W()
+{
+  factorize_QQ();
+  return chol_QQ.solve(cond_rhs());
+}
+
+// E[W|V,Y] solved component by component, as sampleW_VY does when QQ splits
+VectorXd BlockModel::cond_mean_components()
+{
+  if (n_comp == 1) return cond_mean_W();
+  SparseMatrix<double> QQ = cond_precision();
+  return sample_components(QQ, cond_rhs(), false);
+}
+
+// W|Y ~ N(QQ^-1 M, QQ^-1) when V is constant, set W to the mean and keep the covariance
+void BlockModel::set_post_moments()
+{
+  if (n_latent==0) return;
+
+  setW(cond_mean_W());
+  post_cov = chol_QQ.return_Qinv();
+
+  int pos = 0;
+  for (std::vector<std::unique_ptr<Latent>>::iterator it = latents.begin(); it != latents.end(); it++) {
+    int size = (*it)->get_W_size();
+    (*it)->set_post_cov(post_cov.block(pos, pos, size, size));
+    pos += size;
+  }
+}
+
 // ---------------- get, set update gradient ------------------
 VectorXd BlockModel::get_parameter() const {
 if (debug) Rcpp::Rcout << "Start block get parameter"<< std::endl;
@@ -240,10 +486,15 @@ if (debug) Rcpp::Rcout << "Start block gradient"<< std::endl;
 long long time_compute_g = 0;
 long long time_sample_w = 0;
 
+  // exact mode: one pass with the posterior mean and covariance, no sampling
+  int n_samples = exact_gaussian ? 1 : n_gibbs;
+
   VectorXd avg_gradient = VectorXd::Zero(n_params);
-  for (int i=0; i < n_gibbs; i++) {
+  for (int i=0; i < n_samples; i++) {
     // stack grad
     VectorXd gradient = VectorXd::Zero(n_params);
+    if (exact_gaussian) set_post_moments();
+    if (rao_blackwell) compute_cond_moments();
 
 auto timer_computeg = std::chrono::steady_clock::now();
     // get grad for each latent
@@ -264,6 +515,7 @@ time_compute_g += since(timer_computeg).count();
     gradient.segment(n_la_params + n_feff, n_merr) = grad_theta_merr();
 
     avg_gradient += gradient;
+    if (exact_gaussian) continue;
 
     // gibbs sampling
     sampleV_WY();
@@ -274,11 +526,11 @@ time_sample_w += since(timer_sampleW).count();
   }
 
 if (debug) {
-Rcpp::Rcout << "avg time for compute grad (ms): " << time_compute_g / n_gibbs << std::endl;
-Rcpp::Rcout << "avg time for sampling W(ms): " << time_sample_w / n_gibbs << std::endl;
+Rcpp::Rcout << "avg time for compute grad (ms): " << time_compute_g / n_samples << std::endl;
+Rcpp::Rcout << "avg time for sampling W(ms): " << time_sample_w / n_samples << std::endl;
 }
 
-  avg_gradient = (1.0/n_gibbs) * avg_gradient;
+  avg_gradient = (1.0/n_samples) * avg_gradient;
   gradients = avg_gradient;
   // EXAMINE the gradient to change the stepsize
   if (reduce_var) examine_gradient();
@@ -327,7 +579,15 @@ void BlockModel::sampleW_V()
   KW = getMean() + KW;
 
   VectorXd W (W_sizes);
-  if (V_sizes == W_sizes) {
+  if (V_sizes == W_sizes && latent_solve) {
+    // block-wise, structured latents solve with their own factors
+    int pos = 0;
+    for (std::vector<std::unique_ptr<Latent>>::iterator it = latents.begin(); it != latents.end(); it++) {
+      int size = (*it)->get_W_size();
+      W.segment(pos, size) = (*it)->solve_K(KW.segment(pos, size));
+      pos += size;
+    }
+  } else if (V_sizes == W_sizes) {
     LU_K.factorize(K);
     W = LU_K.solve(KW);
   } else {
@@ -341,18 +601,41 @@ void BlockModel::sampleW_V()
 
 // --------- Fiexed effects and Measurement Error ---------------
 VectorXd BlockModel::grad_beta() {
-  VectorXd noise_V = var.getV();
-  VectorXd noise_inv_SV = noise_V.cwiseProduct(noise_sigma.array().pow(-2).matrix());
+  // mean of beta from the joint sampling pass
+  if (joint_beta) return beta - beta_post;
+
+  // observation precision 1/(sigma^2 V), the same weights as in QQ
+  VectorXd noise_inv_SV = noise_sigma.array().pow(-2).matrix().cwiseQuotient(var.getV());
 
   VectorXd residual = get_residual();
-  VectorXd grads = X.transpose() * noise_inv_SV.asDiagonal() * residual;
-  MatrixXd hess = X.transpose() * noise_inv_SV.asDiagonal() * X;
-  grads = hess.ldlt().solve(grads);
+  VectorXd grads = Xt_times(noise_inv_SV.cwiseProduct(residual));
+  grads = solve_XtDX(noise_inv_SV, grads);
 //   Rcpp::Rcout << "(beta) grads = " << grads << "\n";
 // Rcpp::Rcout << "grads of beta=" << -grads << std::endl;
     return -grads;
 }
 
+// solve (X^T diag(w) X) x = rhs, the factorization is reused until w changes
+VectorXd BlockModel::solve_XtDX(const VectorXd& w, const VectorXd& rhs) {
+  // constant weights (e.g. normal noise with stationary sigma): X^T D X = w0 X^T X
+  double w0 = w(0);
+  if ((w.array() == w0).all()) {
+    if (!XtX_computed) {
+      X_gram(VectorXd::Ones(n_obs), XtX);
+      XtX_ldlt.compute(XtX);
+      XtX_computed = true;
+    }
+    return XtX_ldlt.solve(rhs) / w0;
+  }
+
+  if (XtDX_w.size() != w.size() || XtDX_w != w) {
+    X_gram(w, XtDX);
+    XtDX_ldlt.compute(XtDX);
+    XtDX_w = w;
+  }
+  return XtDX_ldlt.solve(rhs);
+}
+
 VectorXd BlockModel::grad_theta_mu() {
   // VectorXd noise_inv_SV = noise_V.cwiseProduct(noise_sigma.array().pow(-2).matrix());
   // MatrixXd noise_X = (-VectorXd::Ones(n_obs) + noise_V).asDiagonal() * B_mu;
@@ -361,16 +644,19 @@ VectorXd BlockModel::grad_theta_mu() {
   // MatrixXd hess = noise_X.transpose() * noise_inv_SV.asDiagonal() * noise_X;
   // grad = hess.ldlt().solve(grad);
 
-  VectorXd noise_V = var.getV();
-  VectorXd noise_SV = noise_V.cwiseProduct(noise_sigma.array().pow(2).matrix());
+  const VectorXd& noise_V = var.getV();
 
   VectorXd residual = get_residual();
   VectorXd grad (n_theta_mu);
-  for (int l=0; l < n_theta_mu; l++) {
-
-      // LU_K.factorize(getK());
-      // VectorXd tmp = residual + LU.solve(-h + )
-      grad(l) = (noise_V - VectorXd::Ones(n_obs)).cwiseProduct(B_mu.col(l).cwiseQuotient(noise_SV)).dot(residual);
+  if (var.use_rao_blackwell()) {
+    // (1 - 1/V) * (r - mu V) with r = residual + mu V, take E[.|W,Y]
+    VectorXd r = residual + noise_V.cwiseProduct(noise_mu);
+    VectorXd tmp = r + noise_mu - noise_mu.cwiseProduct(var.getEV()) - r.cwiseProduct(var.getEiV());
+    grad = B_mu.t_times(tmp.cwiseProduct(noise_sigma.array().pow(-2).matrix()));
+  } else {
+    // grad(l) = sum B_mu(., l) (V-1) residual / (sigma^2 V)
+    VectorXd wgt = (noise_V.array() - 1) * residual.array() / (noise_sigma.array().square() * noise_V.array());
+    grad = B_mu.t_times(wgt);
   }
   grad = - 1.0 / n_obs * grad;
   return grad;
@@ -378,14 +664,24 @@ VectorXd BlockModel::grad_theta_mu() {
 
 VectorXd BlockModel::grad_theta_sigma() {
   VectorXd grad = VectorXd::Zero(n_theta_sigma);
-  VectorXd noise_V = var.getV();
-  VectorXd noise_SV = noise_sigma.array().pow(2).matrix().cwiseProduct(noise_V);
+  const VectorXd& noise_V = var.getV();
   // grad = B_sigma.transpose() * (-0.5 * VectorXd::Ones(n_obs) + residual.array().pow(2).matrix().cwiseQuotient(noise_SV));
 
   VectorXd residual = get_residual();
-  VectorXd vsq = (residual).array().pow(2).matrix().cwiseProduct(noise_V.cwiseInverse());
-  VectorXd tmp1 = vsq.cwiseProduct(noise_sigma.array().pow(-2).matrix()) - VectorXd::Constant(n_obs, 1);
-  grad = B_sigma.transpose() * tmp1;
+  VectorXd vsq;
+  if (var.use_rao_blackwell()) {
+    // (r - mu V)^2 / V with r = residual + mu V, take E[.|W,Y]
+    VectorXd r = residual.array() + noise_V.array() * noise_mu.array();
+    vsq = r.array().square() * var.getEiV().array()
+      - 2 * noise_mu.array() * r.array()
+      + noise_mu.array().square() * var.getEV().array();
+  } else {
+    vsq = residual.array().square() / noise_V.array();
+    if (exact_gaussian && n_latent > 0)
+      vsq.array() += diag_BSBt(A, post_cov).array() / noise_V.array();
+  }
+  VectorXd tmp1 = vsq.array() / noise_sigma.array().square() - 1;
+  grad = B_sigma.t_times(tmp1);
 
   // grad = - 0.5* B_sigma.transpose() * VectorXd::Ones(n_obs)
   // + B_sigma.transpose() * noise_sigma.array().pow(-2).matrix() * residual.cwiseProduct(noise_V.cwiseInverse()).dot(residual);
@@ -404,7 +700,7 @@ VectorXd BlockModel::grad_theta_sigma() {
 VectorXd BlockModel::get_theta_merr() const {
   VectorXd theta_merr = VectorXd::Zero(n_merr);
 
-  if (family=="normal") {
+  if (family_type == noise_normal) {
       theta_merr = theta_sigma;
   } else {
       theta_merr.segment(0, n_theta_mu) = theta_mu;
@@ -418,7 +714,7 @@ VectorXd BlockModel::get_theta_merr() const {
 VectorXd BlockModel::grad_theta_merr() {
   VectorXd grad = VectorXd::Zero(n_merr);
 
-  if (family=="normal") {
+  if (family_type == noise_normal) {
     if (!fix_flag[block_fix_theta_sigma])  grad = grad_theta_sigma();
   } else {
     if (!fix_flag[block_fix_theta_mu])     grad.segment(0, n_theta_mu) = grad_theta_mu();
@@ -430,7 +726,7 @@ VectorXd BlockModel::grad_theta_merr() {
 }
 
 void BlockModel::set_theta_merr(const VectorXd& theta_merr) {
-  if (family=="normal") {
+  if (family_type == noise_normal) {
     theta_sigma = theta_merr;
   } else {
     theta_mu = theta_merr.segment(0, n_theta_mu);
@@ -439,8 +735,8 @@ void BlockModel::set_theta_merr(const VectorXd& theta_merr) {
   }
 
   // update mu, sigma
-  noise_mu = (B_mu * theta_mu);
-  noise_sigma = (B_sigma * theta_sigma).array().exp();
+  noise_mu = (B_mu.times(theta_mu));
+  noise_sigma = (B_sigma.times(theta_sigma)).array().exp();
 }
 
 // generate output to R
@@ -462,45 +758,133 @@ Rcpp::List BlockModel::output() const {
     Rcpp::Named("latents")          = latents_output
   );
 
-  out.attr("trajectory") = Rcpp::List::create(
-    Rcpp::Named("beta")        = beta_traj,
-    Rcpp::Named("theta_mu")    = theta_mu_traj,
-    Rcpp::Named("theta_sigma") = theta_sigma_traj,
-    Rcpp::Named("theta_V")     = theta_V_traj
-  );
+  out.attr("trajectory") = trajectory_output(traj, Rcpp::IntegerVector::create(
+    Rcpp::Named("beta")        = n_feff,
+    Rcpp::Named("theta_mu")    = n_theta_mu,
+    Rcpp::Named("theta_sigma") = n_theta_sigma,
+    Rcpp::Named("theta_V")     = 1
+  ));
   return out;
 }
 
-// posterior
-Rcpp::List BlockModel::sampling(int iterations, bool posterior) {
-  std::vector<VectorXd> Ws;
-  std::vector<VectorXd> Vs;
-  std::vector<VectorXd> Block_Vs;
+void BlockModel::save(BinaryWriter& out) const {
+  out.write(curr_iter);
+  out.write(counting);
+  out.write(beta);
+  out.write(theta_mu);
+  out.write(theta_sigma);
+  out.write(stepsizes);
+  out.write(indicate_threshold);
+  out.write(steps_to_threshold);
+  out.write(rng);
+  out.write<int64_t>(comp_rngs.size());
+  for (const std::mt19937& r : comp_rngs) out.write(r);
+  out.write(chol_QQ.ordering());
+  var.save(out);
+  traj.save(out);
+
+  out.write(n_latent);
+  for (int i=0; i < n_latent; i++)
+    latents[i]->save(out);
+}
+
+void BlockModel::load(BinaryReader& in) {
+  in.read(curr_iter);
+  in.read(counting);
+  in.read(beta);
+  in.read(theta_mu);
+  in.read(theta_sigma);
+  in.read(stepsizes);
+  in.read(indicate_threshold);
+  in.read(steps_to_threshold);
+  in.read(rng);
+  comp_rngs.resize(in.read<int64_t>());
+  for (std::mt19937& r : comp_rngs) in.read(r);
+
+  // the ordering is a deterministic function of the pattern of QQ
+  Eigen::VectorXi ordering;
+  in.read(ordering);
+  Eigen::VectorXi curr_ordering = chol_QQ.ordering();
+  if (ordering.size() > 0 && curr_ordering.size() > 0 && ordering != curr_ordering)
+    Rcpp::Rcout << "The ordering of QQ differs from the checkpoint, the chain continues with the new one." << std::endl;
+  var.load(in);
+  traj.load(in);
+
+  int n_latent_in = in.read<int>();
+  if (n_latent_in != n_latent)
+    throw("checkpoint does not match the model");
+  for (int i=0; i < n_latent; i++)
+    latents[i]->load(in);
+
+  beta_post = beta;
+  noise_mu = B_mu.times(theta_mu);
+  noise_sigma = B_sigma.times(theta_sigma).array().exp();
+  assemble();
+}
 
-  burn_in(5);
+// posterior (or prior) draws
+void BlockModel::sampling(SamplingRecord& rec, int iterations, bool posterior, int burnin, int thin) {
+  auto record = [](Trajectory& draws, const VectorXd& x) {
+    if (draws.cols() == 0 || !draws.begin_row()) return;
+    draws.set(0, x);
+    draws.end_row();
+  };
+
+  burn_in(burnin);
 
   for (int i=0; i < iterations; i++) {
-    if (posterior) {
-      sampleV_WY();
-      sampleW_VY();
-      sample_cond_block_V();
-    } else {
-      sample_V();
-      sampleW_V();
-      var.sample_V();
-      // construct the Y in R
+    for (int j=0; j < std::max(thin, 1); j++) {
+      if (posterior) {
+        sampleV_WY();
+        sampleW_VY();
+        sample_cond_block_V();
+      } else {
+        sample_V();
+        sampleW_V();
+        var.sample_V();
+        // construct the Y in R
+      }
     }
 
-    Ws.push_back(getW());
-    Vs.push_back(getV());
-    Block_Vs.push_back(var.getV());
+    VectorXd W = getW(), V = getV();
+    if (rec.summary) {
+      rec.W.add(W);
+      rec.V.add(V);
+      rec.block_V.add(var.getV());
+    }
+    record(rec.draws_W, W);
+    record(rec.draws_V, V);
+    record(rec.draws_block_V, var.getV());
+
+    if (rec.A_pred) {
+      rec.W_batch.col(rec.n_batch++) = W;
+      if (rec.n_batch == rec.W_batch.cols()) flush_pred(rec);
+    }
   }
+  if (rec.A_pred) flush_pred(rec);
+}
 
-  return Rcpp::List::create(
-    Rcpp::Named("Ws") = Ws,
-    Rcpp::Named("Vs") = Vs,
-    Rcpp::Named("Block_Vs") = Block_Vs
-  );
+void BlockModel::flush_pred(SamplingRecord& rec) const {
+  if (rec.n_batch == 0) return;
+  MatrixXd lp = *rec.A_pred * rec.W_batch.leftCols(rec.n_batch);
+  for (int j=0; j < rec.n_batch; j++)
+    rec.pred.add(lp.col(j) + rec.pred_offset);
+  rec.n_batch = 0;
+}
+
+// diag(QQ^-1) from the selected inverse (exact if all noises are normal),
+// factorize = false reuses the factorization and selected inverse of predict_exact
+VectorXd BlockModel::post_var_W(bool factorize)
+{
+  if (n_latent == 0) return VectorXd();
+  if (factorize) factorize_QQ();
+  return chol_QQ.Qinv_diag();
+}
+
+// mean and variance of A_pred W given V, the variances from the selected inverse of QQ
+void BlockModel::predict_exact(const SparseMatrix<double, Eigen::RowMajor>& A_pred, VectorXd& pred_mean, VectorXd& pred_var, int batch_size) {
+  pred_mean = A_pred * cond_mean_W();
+  pred_var = chol_QQ.Qinv_diag(A_pred, batch_size);
 }
 
 // provide stepsize
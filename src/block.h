@@ -17,6 +17,8 @@ BlockModel
 #include "include/timer.h"
 #include "include/solver.h"
 #include "include/MatrixAlgebra.h"
+#include "include/ellmatrix.h"
+#include "include/summary.h"
 #include "model.h"
 #include "var.h"
 #include "latent.h"
@@ -31,24 +33,43 @@ enum Block_fix_flag {
     block_fix_beta, block_fix_theta_mu, block_fix_theta_sigma
 };
 
+// running summaries and kept draws of W, V and the block V of one sampling chain
+struct SamplingRecord {
+    bool summary {false};
+    PosteriorSummary W, V, block_V;
+    Trajectory draws_W, draws_V, draws_block_V;
+
+    // linear predictor pred_offset + A_pred W at new locations, summarized
+    // in batches of draws (one SpMM per batch)
+    const SparseMatrix<double, Eigen::RowMajor>* A_pred {nullptr};
+    VectorXd pred_offset;
+    PosteriorSummary pred;
+    MatrixXd W_batch;
+    int n_batch {0};
+};
+
 class BlockModel : public Model {
 protected:
 // W_sizes = row(A1) + ... + row(An)
     // general
     std::mt19937 rng;
 
+    // X is kept sparse (X_sp) when passed as a dgCMatrix
+    bool sparse_X {false};
     MatrixXd X;
+    SparseMatrix<double> X_sp;
     VectorXd Y;
     int W_sizes, V_sizes; //V_sizes = sum(nrow(K_i))
     string family;
+    Noise_type family_type;
 
     // Fixed effects and Measurement noise
     VectorXd beta;
-    MatrixXd B_mu;
+    Basis B_mu;
     VectorXd noise_mu, theta_mu;
     int n_theta_mu;
 
-    MatrixXd B_sigma;
+    Basis B_sigma;
     VectorXd noise_sigma, theta_sigma;
     int n_theta_sigma;
 
@@ -61,11 +82,19 @@ protected:
 
     // controls
     int n_gibbs;
-    bool debug,opt_beta, reduce_var;
+    bool debug,opt_beta, reduce_var, rao_blackwell, exact_gaussian, joint_beta;
     double reduce_power, threshold;
 
     SparseMatrix<double> A, K;      // not used: dK, d2K;
 
+    // solve K W = KW latent by latent (replicated or Kronecker latents)
+    bool latent_solve {false};
+
+    // A in fixed-k row format (indicator / barycentric rows), AtDA_pattern holds the pattern of A^T A
+    bool structured_A {false};
+    ELLMatrix A_ell;
+    SparseMatrix<double> AtDA_pattern;
+
     std::vector<std::unique_ptr<Latent>> latents;
     Var var;
 
@@ -79,11 +108,30 @@ protected:
     cholesky_solver chol_Q, chol_QQ;
     SparseLU<SparseMatrix<double> > LU_K;
 
+    // independent blocks of QQ: comp_perm groups the components contiguously,
+    // each has its own symbolic analysis and rng stream
+    int n_comp {1};
+    Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> comp_perm;
+    std::vector<int> comp_start, comp_size;
+    std::vector<std::unique_ptr<cholesky_solver>> chol_comps;
+    std::vector<std::mt19937> comp_rngs;
+
+    // selected inverse of QQ (exact Gaussian mode)
+    SparseMatrix<double> post_cov;
+
+    // cached X^T D X and its factorization (D = XtDX_w), XtX for constant weights
+    MatrixXd XtDX, XtX;
+    Eigen::LDLT<MatrixXd> XtDX_ldlt, XtX_ldlt;
+    VectorXd XtDX_w;
+    bool XtX_computed {false};
+
+    // joint sampling of [W; beta], beta_post is the mean of beta|V,Y
+    cholesky_solver chol_QQ_beta;
+    VectorXd beta_post;
+
     // record trajectory
-    vector<vector<double>> beta_traj;
-    vector<vector<double>> theta_mu_traj;
-    vector<vector<double>> theta_sigma_traj;
-    vector<double>   theta_V_traj;
+    // columns beta, theta_mu, theta_sigma, theta_V
+    Trajectory traj;
 
     std::string par_string;
 
@@ -92,6 +140,16 @@ public:
     BlockModel(const Rcpp::List& block_model, unsigned long seed);
     virtual ~BlockModel() {}
 
+    // chain state for checkpointing (parameters, V/W, step sizes, rng streams, trajectories)
+    void save(BinaryWriter& out) const;
+    void load(BinaryReader& in);
+    // streamed trajectories are on disk up to the rows save records
+    void flush_traj() {
+      traj.flush();
+      for (int i=0; i < n_latent; i++) latents[i]->flush_traj();
+    }
+
+
     /* Gibbs Sampler */
     void burn_in(int iterations) {
         for (int i=0; i < iterations; i++) {
@@ -103,6 +161,19 @@ public:
     }
 
     void sampleW_VY();
+    void sampleWbeta_VY();
+    VectorXd factorize_QQ_beta();
+    VectorXd cond_mean_Wbeta();
+    void init_components(SparseMatrix<double>& QQ);
+    VectorXd sample_components(SparseMatrix<double>& QQ, const VectorXd& M, bool sample = true);
+    int get_n_comp() const {return n_comp;}
+    SparseMatrix<double> joint_precision(const VectorXd& inv_SV, const VectorXd& noise_inv_SV) const;
+    SparseMatrix<double> cond_precision() const;
+    VectorXd cond_rhs() const;
+    void factorize_QQ();
+    VectorXd cond_mean_W();
+    VectorXd cond_mean_components();
+    void set_post_moments();
     void sampleV_WY() {
       if(n_latent > 0){
         for (unsigned i=0; i < n_latent; i++) {
@@ -135,16 +206,12 @@ public:
 
     // record traj. for mu sigma eta
     void record_traj() {
-        for (int i=0; i < beta.size(); i++) {
-            beta_traj[i].push_back(beta(i));
-        }
-        for (int i=0; i < theta_mu.size(); i++) {
-            theta_mu_traj[i].push_back(theta_mu(i));
-        }
-        for (int i=0; i < theta_sigma.size(); i++) {
-            theta_sigma_traj[i].push_back(theta_sigma(i));
-        }
-        theta_V_traj.push_back(var.get_theta_V());
+        if (traj.cols() == 0 || !traj.begin_row()) return;
+        traj.set(0, beta);
+        traj.set(n_feff, theta_mu);
+        traj.set(n_feff + n_theta_mu, theta_sigma);
+        traj.set(n_feff + n_theta_mu + n_theta_sigma, var.get_theta_V());
+        traj.end_row();
     }
 
     /* Aseemble */
@@ -234,21 +301,34 @@ public:
 
     VectorXd get_residual() const {
       if(n_latent>0){
-        return Y - A * getW() - X * beta - (-VectorXd::Ones(n_obs) + var.getV()).cwiseProduct(noise_mu);
+        return Y - A_times(getW()) - X_times(beta) - (-VectorXd::Ones(n_obs) + var.getV()).cwiseProduct(noise_mu);
       }else{
-        return Y  - X * beta - (-VectorXd::Ones(n_obs) + var.getV()).cwiseProduct(noise_mu);
+        return Y  - X_times(beta) - (-VectorXd::Ones(n_obs) + var.getV()).cwiseProduct(noise_mu);
       }
     }
 
     void sample_cond_block_V() {
-        if (family == "nig") {
+        if (family_type == noise_nig) {
             VectorXd residual = get_residual();
-            VectorXd a_inc_vec = noise_mu.cwiseQuotient(noise_sigma).array().pow(2);
-            VectorXd b_inc_vec = (residual + var.getV().cwiseProduct(noise_mu)).cwiseQuotient(noise_sigma).array().pow(2);
+            VectorXd a_inc_vec = (noise_mu.array() / noise_sigma.array()).square();
+            VectorXd b_inc_vec = ((residual.array() + var.getV().array() * noise_mu.array()) / noise_sigma.array()).square();
             var.sample_cond_V(a_inc_vec, b_inc_vec);
         }
     }
 
+    // E[V|W,Y] and E[1/V|W,Y] of every noise (Rao-Blackwellized gradients)
+    void compute_cond_moments() {
+        for (unsigned i=0; i < n_latent; i++) {
+            (*latents[i]).compute_cond_moments();
+        }
+        if (var.use_rao_blackwell()) {
+            VectorXd residual = get_residual();
+            VectorXd a_inc_vec = (noise_mu.array() / noise_sigma.array()).square();
+            VectorXd b_inc_vec = ((residual.array() + var.getV().array() * noise_mu.array()) / noise_sigma.array()).square();
+            var.compute_cond_moments(a_inc_vec, b_inc_vec);
+        }
+    }
+
     // for updating hessian
     vector<VectorXd> get_VW() const {
         vector<VectorXd> ret (3);
@@ -266,6 +346,35 @@ public:
 
     // --------- Fixed effects and Measurement error  ------------
     VectorXd grad_beta();
+    VectorXd solve_XtDX(const VectorXd& w, const VectorXd& rhs);
+
+    // products with A, dispatching on structured_A
+    VectorXd A_times(const VectorXd& v) const {
+        return structured_A ? A_ell.times(v) : VectorXd(A * v);
+    }
+    VectorXd At_times(const VectorXd& v) const {
+        return structured_A ? A_ell.t_times(v) : VectorXd(A.transpose() * v);
+    }
+    // A^T diag(w) A
+    SparseMatrix<double> obs_precision(const VectorXd& w) const {
+        if (!structured_A) return A.transpose() * w.asDiagonal() * A;
+        SparseMatrix<double> AtDA = AtDA_pattern;
+        A_ell.weighted_gram(w, AtDA);
+        return AtDA;
+    }
+
+    // products with X, dispatching on sparse_X
+    VectorXd X_times(const VectorXd& v) const {
+        return sparse_X ? VectorXd(X_sp * v) : VectorXd(X * v);
+    }
+    VectorXd Xt_times(const VectorXd& v) const {
+        return sparse_X ? VectorXd(X_sp.transpose() * v) : VectorXd(X.transpose() * v);
+    }
+    // G = X^T diag(w) X
+    void X_gram(const VectorXd& w, MatrixXd& G) const {
+        if (sparse_X) G = MatrixXd(X_sp.transpose() * w.asDiagonal() * X_sp);
+        else weighted_gram(X, w, G);
+    }
 
     VectorXd get_theta_merr() const;
     VectorXd grad_theta_mu();
@@ -273,8 +382,18 @@ public:
     VectorXd grad_theta_merr();
     void set_theta_merr(const VectorXd& theta_merr);
 
-    // get length of W,V of iterations
-    Rcpp::List sampling(int iterations, bool posterior);
+    // burnin sweeps, then iterations draws (one every thin sweeps) into rec,
+    // touches no R object, so chains can run in parallel
+    void sampling(SamplingRecord& rec, int iterations, bool posterior, int burnin, int thin);
+    void flush_pred(SamplingRecord& rec) const;
+
+    // marginal variances of W given V and Y
+    VectorXd post_var_W(bool factorize=true);
+    // mean and variance of A_pred W given V and Y (exact if all noises are normal)
+    void predict_exact(const SparseMatrix<double, Eigen::RowMajor>& A_pred, VectorXd& pred_mean, VectorXd& pred_var, int batch_size);
+    int get_W_sizes() const {return W_sizes;}
+    int get_V_sizes() const {return V_sizes;}
+    int get_n_obs() const {return n_obs;}
     Rcpp::List output() const;
     std::string get_par_string() const {return par_string;}
 };
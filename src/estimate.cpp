@@ -3,6 +3,8 @@
 #include "optimizer.h"
 #include "block.h"
 #include "timer.h"
+#include "include/serialize.h"
+#include "include/model_file.h"
 
 #ifdef _OPENMP
     #include<omp.h>
@@ -14,6 +16,10 @@
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
 #include <random>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <cstdio>
 
 using Eigen::SparseMatrix;
 using Eigen::VectorXd;
@@ -23,6 +29,65 @@ using namespace Rcpp;
 
 bool check_conv(const MatrixXd&, const MatrixXd&, int, int, double, double, std::string, bool);
 
+const char CHECKPOINT_MAGIC[8] = {'N', 'G', 'M', 'E', 'C', 'K', 'P', 'T'};
+const int CHECKPOINT_VERSION = 1;
+
+// chains, iterations done, batch counter and the convergence statistics
+std::string checkpoint(const std::vector<std::unique_ptr<BlockModel>>& blocks,
+                       int steps, int curr_batch, const MatrixXd& means, const MatrixXd& vars) {
+    BinaryWriter out;
+    out.write_raw(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    out.write(CHECKPOINT_VERSION);
+    out.write<int>(blocks.size());
+    out.write(steps);
+    out.write(curr_batch);
+    out.write(means);
+    out.write(vars);
+    for (const std::unique_ptr<BlockModel>& block : blocks) {
+        block->flush_traj();
+        block->save(out);
+    }
+    return out.release();
+}
+
+// failed writes of the background checkpoint writer, reported from the main thread
+void report_checkpoint_error(AsyncFileWriter& writer) {
+    std::string msg = writer.take_error();
+    if (!msg.empty())
+        Rcpp::warning("%s, the last checkpoint may be missing or stale", msg);
+}
+
+// false if there is no usable checkpoint
+bool restore(const std::string& file, std::vector<std::unique_ptr<BlockModel>>& blocks,
+             int& steps, int& curr_batch, MatrixXd& means, MatrixXd& vars) {
+    std::string buf;
+    if (file.empty() || !read_file(file, buf)) return false;
+
+    BinaryReader in (buf);
+    char magic[8];
+    in.read_raw(magic, sizeof(magic));
+    if (std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 || in.read<int>() != CHECKPOINT_VERSION) {
+        Rcpp::Rcout << "Not a checkpoint of this version, start from the beginning." << std::endl;
+        return false;
+    }
+    if (in.read<int>() != (int) blocks.size()) {
+        Rcpp::Rcout << "The checkpoint has a different number of chains, start from the beginning." << std::endl;
+        return false;
+    }
+    try {
+        in.read(steps);
+        in.read(curr_batch);
+        in.read(means);
+        in.read(vars);
+        for (std::unique_ptr<BlockModel>& block : blocks)
+            block->load(in);
+    } catch (const char* msg) {
+        // the chains are partly restored, do not continue from them
+        Rcpp::stop(std::string("can not resume from ") + file + ": " + msg);
+    }
+    return true;
+}
+
 // [[Rcpp::plugins(openmp)]]
 // [[Rcpp::export]]
 Rcpp::List estimate_cpp(const Rcpp::List& ngme_block) {
@@ -39,6 +104,13 @@ Rcpp::List estimate_cpp(const Rcpp::List& ngme_block) {
     Rcpp::List trajectory = R_NilValue;
     Rcpp::List output = R_NilValue;
 
+    // periodic checkpoints, written in the background
+    const std::string ckpt_file = Rf_isNull(control_in["checkpoint_file"]) ? "" : Rcpp::as<std::string> (control_in["checkpoint_file"]);
+    const int ckpt_every = control_in["checkpoint_every"];
+    const bool resume = control_in["resume"];
+    std::unique_ptr<AsyncFileWriter> ckpt_writer;
+    if (!ckpt_file.empty()) ckpt_writer = std::make_unique<AsyncFileWriter>(ckpt_file);
+
 auto timer = std::chrono::steady_clock::now();
 
     Rcpp::List outputs;
@@ -61,11 +133,6 @@ auto timer = std::chrono::steady_clock::now();
     }
     std::string par_string = blocks[0]->get_par_string();
 
-    // burn in period
-    #pragma omp parallel for schedule(static)
-    for (i=0; i < n_chains; i++)
-        (blocks[i])->burn_in(burnin+3);
-
     int n_params = blocks[0]->get_n_params();
     MatrixXd means (n_batch, n_params);
     MatrixXd vars (n_batch, n_params);
@@ -75,6 +142,27 @@ auto timer = std::chrono::steady_clock::now();
     int batch_steps = (iterations / n_batch);
 
     int curr_batch = 0;
+    bool resumed = resume && restore(ckpt_file, blocks, steps, curr_batch, means, vars);
+    if (resumed) {
+        Rcpp::Rcout << "Resume from the checkpoint after " << steps << " iterations." << std::endl;
+        // the resumed run may have more iterations than the checkpointed one
+        int n_rows = curr_batch + std::max(iterations - steps + batch_steps - 1, 0) / std::max(batch_steps, 1);
+        if (means.cols() != n_params)
+            Rcpp::stop("can not resume from " + ckpt_file + ": checkpoint does not match the model");
+        if (means.rows() < n_rows) {
+            means.conservativeResize(n_rows, n_params);
+            vars.conservativeResize(n_rows, n_params);
+        }
+    }
+
+    // burn in period
+    if (!resumed) {
+        #pragma omp parallel for schedule(static)
+        for (i=0; i < n_chains; i++)
+            (blocks[i])->burn_in(burnin+3);
+    }
+
+    int last_ckpt = steps;
     while (steps < iterations && !converge) {
         MatrixXd mat (n_chains, n_params);
         #pragma omp parallel for schedule(static)
@@ -108,6 +196,12 @@ auto timer = std::chrono::steady_clock::now();
                 converge = check_conv(means, vars, curr_batch, n_slope_check, std_lim, trend_lim, par_string, print_check_info);
         }
         curr_batch++;
+
+        if (ckpt_writer && steps - last_ckpt >= ckpt_every) {
+            ckpt_writer->submit(checkpoint(blocks, steps, curr_batch, means, vars));
+            last_ckpt = steps;
+            report_checkpoint_error(*ckpt_writer);
+        }
     }
 
     // generate outputs
@@ -120,25 +214,450 @@ auto timer = std::chrono::steady_clock::now();
         Rcpp::Rcout << "Not sure about the convergence." << std::endl;
 
 #else // No parallel chain
-    BlockModel block (ngme_block, rng());
+    std::vector<std::unique_ptr<BlockModel>> blocks;
+    blocks.push_back(std::make_unique<BlockModel>(ngme_block, rng()));
+    BlockModel& block = *blocks[0];
+
+    int steps = 0, curr_batch = 0;
+    MatrixXd means, vars;
+    if (resume && restore(ckpt_file, blocks, steps, curr_batch, means, vars))
+        Rcpp::Rcout << "Resume from the checkpoint after " << steps << " iterations." << std::endl;
+
     Optimizer opt;
-    trajectory = opt.sgd(block, 0.1, iterations, max_relative_step, max_absolute_step);
-    Rcpp::List ngme = block.output();
+    while (steps < iterations) {
+        int n_steps = ckpt_writer ? std::min(std::max(ckpt_every, 1), iterations - steps) : iterations - steps;
+        opt.sgd(block, 0.1, n_steps, max_relative_step, max_absolute_step);
+        steps += n_steps;
+        if (ckpt_writer) {
+            ckpt_writer->submit(checkpoint(blocks, steps, curr_batch, means, vars));
+            report_checkpoint_error(*ckpt_writer);
+        }
+    }
     outputs.push_back(block.output());
 #endif
 
+    // wait for the last checkpoint
+    if (ckpt_writer) {
+        ckpt_writer->close();
+        report_checkpoint_error(*ckpt_writer);
+    }
+
 Rcpp::Rcout << "Total time is (ms): " << since(timer).count() << std::endl;
 
     return outputs;
 }
 
+// list(mean, var, quantiles, exceedance, probs, thresholds, draws) for R
+Rcpp::List summary_output(const PosteriorSummary& s) {
+    return Rcpp::List::create(
+        Rcpp::Named("mean")         = s.mean(),
+        Rcpp::Named("var")          = s.variance(),
+        Rcpp::Named("quantiles")    = s.quantiles(),
+        Rcpp::Named("exceedance")   = s.exceedance(),
+        Rcpp::Named("probs")        = s.get_probs(),
+        Rcpp::Named("thresholds")   = s.get_thresholds(),
+        Rcpp::Named("draws")        = s.draws()
+    );
+}
+
+// [[Rcpp::export]]
+Rcpp::List sampling_cpp(const Rcpp::List& ngme_block, int iterations, bool posterior, const Rcpp::List& control_sampling) {
+    unsigned long seed = Rcpp::as<unsigned long> (ngme_block["seed"]);
+    std::mt19937 rng (seed);
+
+    const int n_chains = std::max(Rcpp::as<int> (control_sampling["n_chains"]), 1);
+    const int burnin = control_sampling["burnin"];
+    const int thin = control_sampling["thin"];
+    const bool summary = control_sampling["summary"];
+    const int store_thin = control_sampling["store_thin"];
+    const bool store_single = control_sampling["store_single"];
+    const std::string store_file = Rf_isNull(control_sampling["store_file"]) ? "" : Rcpp::as<std::string> (control_sampling["store_file"]);
+    VectorXd probs, thresholds;
+    if (summary) {
+        probs = Rcpp::as<VectorXd> (control_sampling["probs"]);
+        if (!Rf_isNull(control_sampling["thresholds"]))
+            thresholds = Rcpp::as<VectorXd> (control_sampling["thresholds"]);
+    }
+
+    // one model and record per chain, each chain has its own rng stream
+    std::vector<std::unique_ptr<BlockModel>> blocks;
+    std::vector<std::unique_ptr<SamplingRecord>> records;
+    for (int i=0; i < n_chains; i++) {
+        blocks.push_back(std::make_unique<BlockModel>(ngme_block, rng()));
+        records.push_back(std::make_unique<SamplingRecord>());
+        const BlockModel& block = *blocks.back();
+        SamplingRecord& rec = *records.back();
+
+        // O(n) running summaries
+        rec.summary = summary;
+        if (summary) {
+            rec.W.init(block.get_W_sizes(), probs, thresholds);
+            rec.V.init(block.get_V_sizes(), probs, thresholds);
+            rec.block_V.init(block.get_n_obs(), probs, thresholds);
+        }
+
+        // every store_thin-th draw, in memory or streamed to store_file_chain<i>_*.bin
+        if (store_thin > 0) {
+            std::string prefix = store_file.empty() ? "" : store_file + "_chain" + std::to_string(i + 1);
+            rec.draws_W.init(block.get_W_sizes(), iterations, store_thin, store_single, prefix.empty() ? "" : prefix + "_W.bin");
+            rec.draws_V.init(block.get_V_sizes(), iterations, store_thin, store_single, prefix.empty() ? "" : prefix + "_V.bin");
+            rec.draws_block_V.init(block.get_n_obs(), iterations, store_thin, store_single, prefix.empty() ? "" : prefix + "_block_V.bin");
+        }
+    }
+
+#ifdef _OPENMP
+    omp_set_num_threads(n_chains);
+#endif
+    #pragma omp parallel for schedule(static)
+    for (int i=0; i < n_chains; i++)
+        blocks[i]->sampling(*records[i], iterations, posterior, burnin, thin);
+
+    Rcpp::List summary_out, draws_out;
+    if (summary) {
+        SamplingRecord& rec = *records[0];
+        for (int i=1; i < n_chains; i++) {
+            rec.W.merge(records[i]->W);
+            rec.V.merge(records[i]->V);
+            rec.block_V.merge(records[i]->block_V);
+        }
+        summary_out = Rcpp::List::create(
+            Rcpp::Named("W")        = summary_output(rec.W),
+            Rcpp::Named("V")        = summary_output(rec.V),
+            Rcpp::Named("block_V")  = summary_output(rec.block_V)
+        );
+    }
+    if (store_thin > 0) {
+        for (int i=0; i < n_chains; i++) {
+            const SamplingRecord& rec = *records[i];
+            draws_out.push_back(Rcpp::List::create(
+                Rcpp::Named("W")        = trajectory_output(rec.draws_W, Rcpp::IntegerVector::create(Rcpp::Named("W") = rec.draws_W.cols())),
+                Rcpp::Named("V")        = trajectory_output(rec.draws_V, Rcpp::IntegerVector::create(Rcpp::Named("V") = rec.draws_V.cols())),
+                Rcpp::Named("block_V")  = trajectory_output(rec.draws_block_V, Rcpp::IntegerVector::create(Rcpp::Named("block_V") = rec.draws_block_V.cols()))
+            ));
+        }
+    }
+
+    return Rcpp::List::create(
+        Rcpp::Named("summary")  = summary ? (SEXP) summary_out : R_NilValue,
+        Rcpp::Named("draws")    = store_thin > 0 ? (SEXP) draws_out : R_NilValue
+    );
+}
+
+// [[Rcpp::export]]
+Rcpp::List predict_cpp(const Rcpp::List& ngme_block, const Eigen::SparseMatrix<double>& A_pred, const Eigen::MatrixXd& X_pred, const Rcpp::List& control_predict) {
+    unsigned long seed = Rcpp::as<unsigned long> (ngme_block["seed"]);
+    std::mt19937 rng (seed);
+
+    const std::string method = control_predict["method"];
+    const int batch_size = std::max(Rcpp::as<int> (control_predict["batch_size"]), 1);
+    const VectorXd beta = Rcpp::as<VectorXd> (ngme_block["beta"]);
+    if (A_pred.cols() != Rcpp::as<int> (ngme_block["W_sizes"]) || X_pred.cols() != beta.size() ||
+        (X_pred.cols() > 0 && X_pred.rows() != A_pred.rows()))
+        Rcpp::stop("A_pred or X_pred does not match the model");
+
+    // row-major for the (threaded) products and the row support
+    const SparseMatrix<double, Eigen::RowMajor> A_pred_r = A_pred;
+    VectorXd offset = X_pred.cols() > 0 ? VectorXd(X_pred * beta) : VectorXd::Zero(A_pred.rows());
+
+    if (method == "exact") {
+        BlockModel block (ngme_block, rng());
+#ifdef _OPENMP
+        omp_set_num_threads(omp_get_num_procs());
+#endif
+        VectorXd mean, var;
+        block.predict_exact(A_pred_r, mean, var, batch_size);
+        return Rcpp::List::create(
+            Rcpp::Named("mean") = VectorXd(mean + offset),
+            Rcpp::Named("var")  = var
+        );
+    }
+
+    // Gibbs chains as in sampling_cpp, only the linear predictor is summarized
+    Rcpp::List control_sampling = control_predict["control"];
+    const int iterations = control_predict["iterations"];
+    const int n_chains = std::max(Rcpp::as<int> (control_sampling["n_chains"]), 1);
+    const int burnin = control_sampling["burnin"];
+    const int thin = control_sampling["thin"];
+    const VectorXd probs = Rcpp::as<VectorXd> (control_predict["probs"]);
+    VectorXd thresholds;
+    if (!Rf_isNull(control_predict["thresholds"]))
+        thresholds = Rcpp::as<VectorXd> (control_predict["thresholds"]);
+
+    std::vector<std::unique_ptr<BlockModel>> blocks;
+    std::vector<std::unique_ptr<SamplingRecord>> records;
+    for (int i=0; i < n_chains; i++) {
+        blocks.push_back(std::make_unique<BlockModel>(ngme_block, rng()));
+        records.push_back(std::make_unique<SamplingRecord>());
+        SamplingRecord& rec = *records.back();
+        rec.A_pred = &A_pred_r;
+        rec.pred_offset = offset;
+        rec.pred.init(A_pred.rows(), probs, thresholds);
+        rec.W_batch.resize(A_pred.cols(), std::min(batch_size, iterations));
+    }
+
+#ifdef _OPENMP
+    omp_set_num_threads(n_chains);
+#endif
+    #pragma omp parallel for schedule(static)
+    for (int i=0; i < n_chains; i++)
+        blocks[i]->sampling(*records[i], iterations, true, burnin, thin);
+
+    PosteriorSummary& pred = records[0]->pred;
+    for (int i=1; i < n_chains; i++)
+        pred.merge(records[i]->pred);
+
+    return summary_output(pred);
+}
+
 // [[Rcpp::export]]
-Rcpp::List sampling_cpp(const Rcpp::List& ngme_block, int iterations, bool posterior) {
+Rcpp::List post_var_cpp(const Rcpp::List& ngme_block, const Eigen::SparseMatrix<double>& A_pred, int batch_size) {
     unsigned long seed = Rcpp::as<unsigned long> (ngme_block["seed"]);
     std::mt19937 rng (seed);
     BlockModel block (ngme_block, rng());
+    if (A_pred.rows() > 0 && A_pred.cols() != block.get_W_sizes())
+        Rcpp::stop("A_pred does not match the model");
 
-    return block.sampling(iterations, posterior);
+#ifdef _OPENMP
+    omp_set_num_threads(omp_get_num_procs());
+#endif
+    // the selected inverse of one factorization serves both
+    SEXP var_pred = R_NilValue;
+    if (A_pred.rows() > 0) {
+        VectorXd mean, var;
+        block.predict_exact(SparseMatrix<double, Eigen::RowMajor>(A_pred), mean, var, std::max(batch_size, 1));
+        var_pred = Rcpp::wrap(var);
+    }
+    VectorXd var_W = block.post_var_W(A_pred.rows() == 0);
+
+    return Rcpp::List::create(
+        Rcpp::Named("W")        = var_W,
+        Rcpp::Named("A_pred")   = var_pred
+    );
+}
+
+// [[Rcpp::export]]
+void save_model_cpp(const Rcpp::List& ngme_block, std::string file) {
+    unsigned long seed = Rcpp::as<unsigned long> (ngme_block["seed"]);
+    std::mt19937 rng (seed);
+    const VectorXd Y = Rcpp::as<VectorXd> (ngme_block["Y"]);
+    const int W_sizes = ngme_block["W_sizes"];
+    const int V_sizes = ngme_block["V_sizes"];
+
+    ModelFileWriter out;
+
+    // the fitted W and V are read from the object, the latents are only
+    // built to assemble K from the estimated theta_K, latent i is stored under "latent<i>/"
+    Rcpp::List latents_in = ngme_block["latents"];
+    const int n_latent = latents_in.size();
+    SparseMatrix<double,0,int> A (Y.size(), W_sizes), K (V_sizes, W_sizes);
+    int nrow = 0, ncol = 0;
+    for (int i=0; i < n_latent; i++) {
+        Rcpp::List latent_in = latents_in[i];
+        if (latent_in["W"] == R_NilValue)
+            Rcpp::stop("the model is not estimated, W is missing");
+        std::unique_ptr<Latent> latent = create_latent(latent_in, rng());
+        if (!latent)
+            Rcpp::stop("Unknown model: " + Rcpp::as<string> (latent_in["model"]));
+        latent->write_model(out, "latent" + std::to_string(i + 1) + "/");
+        setSparseBlock(&A, 0, ncol, latent->getA());
+        setSparseBlock(&K, nrow, ncol, latent->getK());
+        nrow += latent->get_V_size();
+        ncol += latent->get_W_size();
+    }
+
+    // measurement noise
+    Rcpp::List noise_in = ngme_block["noise"];
+    Var var (noise_in, rng());
+    Basis B_mu, B_sigma;
+    B_mu.set    (Rcpp::as<MatrixXd> (noise_in["B_mu"]));
+    B_sigma.set (Rcpp::as<MatrixXd> (noise_in["B_sigma"]));
+    const VectorXd theta_mu = Rcpp::as<VectorXd> (noise_in["theta_mu"]);
+    const VectorXd theta_sigma = Rcpp::as<VectorXd> (noise_in["theta_sigma"]);
+
+    out.add("family",       var.get_noise_type());
+    out.add("n_latent",     n_latent);
+    out.add("beta",         Rcpp::as<VectorXd> (ngme_block["beta"]));
+    out.add("theta_mu",     theta_mu);
+    out.add("theta_sigma",  theta_sigma);
+    out.add("theta_V",      var.get_theta_V());
+    out.add("noise_mu",     B_mu.times(theta_mu));
+    out.add("noise_sigma",  VectorXd(B_sigma.times(theta_sigma).array().exp()));
+    out.add("V",            var.getV());
+    out.add("Y",            Y);
+    SEXP X_in = ngme_block["X"];
+    if (Rf_inherits(X_in, "dgCMatrix")) out.add("X", Rcpp::as<SparseMatrix<double>> (X_in));
+    else                                out.add("X", Rcpp::as<MatrixXd> (X_in));
+    out.add("A",            A);
+    out.add("K",            K);
+
+    std::string buf = out.release();
+
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream os (tmp, std::ios::binary | std::ios::trunc);
+        os.write(buf.data(), buf.size());
+        if (!os) Rcpp::stop("can not write the model file " + file);
+    }
+    if (std::rename(tmp.c_str(), file.c_str()) != 0)
+        Rcpp::stop("can not write the model file " + file);
+}
+
+Rcpp::List read_model_latent(const ModelFile& m, const std::string& prefix) {
+    return Rcpp::List::create(
+        Rcpp::Named("model")        = m.string(prefix + "model"),
+        Rcpp::Named("noise_type")   = m.string(prefix + "noise_type"),
+        Rcpp::Named("theta_K")      = VectorXd(m.vector(prefix + "theta_K")),
+        Rcpp::Named("theta_mu")     = VectorXd(m.vector(prefix + "theta_mu")),
+        Rcpp::Named("theta_sigma")  = VectorXd(m.vector(prefix + "theta_sigma")),
+        Rcpp::Named("theta_V")      = m.scalar(prefix + "theta_V"),
+        Rcpp::Named("V")            = VectorXd(m.vector(prefix + "V")),
+        Rcpp::Named("W")            = VectorXd(m.vector(prefix + "W")),
+        Rcpp::Named("h")            = VectorXd(m.vector(prefix + "h")),
+        Rcpp::Named("K")            = SparseMatrix<double>(m.sparse(prefix + "K")),
+        Rcpp::Named("A")            = SparseMatrix<double>(m.sparse(prefix + "A"))
+    );
+}
+
+/*
+    Posterior of W given V from the arrays of a model file, without building the latent models:
+    QQ = K^T diag(1/SV) K + A^T diag(w) A, w = 1 / (noise_sigma^2 V), E[W|V,Y] = QQ^-1 M.
+    Leaves the factorization of QQ in chol_QQ, returns E[W|V,Y] and the W size of every latent.
+*/
+VectorXd model_file_post_mean(const ModelFile& m, cholesky_solver& chol_QQ, Eigen::VectorXi& W_sizes) {
+    const SparseMatrix<double> K = m.sparse("K");
+    const SparseMatrix<double> A = m.sparse("A");
+    const Eigen::Map<const VectorXd> Y = m.vector("Y");
+    const Eigen::Map<const VectorXd> beta = m.vector("beta");
+
+    const int n_latent = m.iscalar("n_latent");
+    W_sizes.resize(n_latent);
+    VectorXd inv_SV (K.rows()), mean (K.rows());
+    int pos = 0;
+    for (int i=0; i < n_latent; i++) {
+        const std::string prefix = "latent" + std::to_string(i + 1) + "/";
+        const Eigen::Map<const VectorXd> V = m.vector(prefix + "V"), sigma = m.vector(prefix + "sigma"),
+                                         mu = m.vector(prefix + "mu"), h = m.vector(prefix + "h");
+        if (pos + V.size() > K.rows() || sigma.size() != V.size() || mu.size() != V.size() || h.size() != V.size())
+            throw("the model file is inconsistent");
+        // SV = sigma^2 V, mean = mu (V - h)
+        inv_SV.segment(pos, V.size()) = (sigma.array().square() * V.array()).inverse();
+        mean.segment(pos, V.size()) = mu.cwiseProduct(V - h);
+        W_sizes(i) = m.vector(prefix + "W").size();
+        pos += V.size();
+    }
+
+    const Eigen::Map<const VectorXd> noise_V = m.vector("V"), noise_mu = m.vector("noise_mu"),
+                                     noise_sigma = m.vector("noise_sigma");
+    const bool sparse_X = m.is_sparse("X");
+    const int X_rows = sparse_X ? m.sparse("X").rows() : m.matrix("X").rows();
+    const int X_cols = sparse_X ? m.sparse("X").cols() : m.matrix("X").cols();
+    if (pos != K.rows() || W_sizes.sum() != K.cols() || A.cols() != K.cols() || A.rows() != Y.size() ||
+        noise_V.size() != Y.size() || noise_mu.size() != Y.size() || noise_sigma.size() != Y.size() ||
+        (beta.size() > 0 && (X_rows != Y.size() || X_cols != beta.size())))
+        throw("the model file is inconsistent");
+
+    VectorXd Xbeta = VectorXd::Zero(Y.size());
+    if (beta.size() > 0)
+        Xbeta = sparse_X ? VectorXd(m.sparse("X") * beta) : VectorXd(m.matrix("X") * beta);
+    VectorXd w = noise_sigma.array().pow(-2).matrix().cwiseQuotient(noise_V);
+    VectorXd residual = Y - Xbeta - (noise_V - VectorXd::Ones(Y.size())).cwiseProduct(noise_mu);
+
+    SparseMatrix<double> QQ = K.transpose() * inv_SV.asDiagonal() * K + A.transpose() * w.asDiagonal() * A;
+    chol_QQ.init(QQ.rows(), 0, 0, 0);
+    chol_QQ.analyze(QQ);
+    chol_QQ.compute(QQ);
+    return chol_QQ.solve(VectorXd(K.transpose() * inv_SV.cwiseProduct(mean) + A.transpose() * w.cwiseProduct(residual)));
+}
+
+// [[Rcpp::export]]
+Rcpp::List predict_file_cpp(std::string file, const Eigen::SparseMatrix<double>& A_pred, const Eigen::MatrixXd& X_pred, int batch_size) {
+    try {
+        ModelFile m (file);
+        const VectorXd beta = m.vector("beta");
+        if (X_pred.cols() != beta.size() || (X_pred.cols() > 0 && X_pred.rows() != A_pred.rows()))
+            Rcpp::stop("A_pred or X_pred does not match the model");
+
+        cholesky_solver chol_QQ;
+        Eigen::VectorXi W_sizes;
+        VectorXd mean_W = model_file_post_mean(m, chol_QQ, W_sizes);
+        if (A_pred.cols() != mean_W.size())
+            Rcpp::stop("A_pred or X_pred does not match the model");
+
+#ifdef _OPENMP
+        omp_set_num_threads(omp_get_num_procs());
+#endif
+        const SparseMatrix<double, Eigen::RowMajor> A_pred_r = A_pred;
+        VectorXd mean = A_pred_r * mean_W;
+        if (X_pred.cols() > 0) mean += X_pred * beta;
+        return Rcpp::List::create(
+            Rcpp::Named("mean") = mean,
+            Rcpp::Named("var")  = chol_QQ.Qinv_diag(A_pred_r, std::max(batch_size, 1))
+        );
+    } catch (const char* msg) {
+        Rcpp::stop(std::string(msg) + ": " + file);
+    }
+    return R_NilValue;
+}
+
+// [[Rcpp::export]]
+Rcpp::List post_var_file_cpp(std::string file, const Eigen::SparseMatrix<double>& A_pred, int batch_size) {
+    try {
+        ModelFile m (file);
+        cholesky_solver chol_QQ;
+        Eigen::VectorXi W_sizes;
+        VectorXd mean_W = model_file_post_mean(m, chol_QQ, W_sizes);
+        if (A_pred.rows() > 0 && A_pred.cols() != mean_W.size())
+            Rcpp::stop("A_pred does not match the model");
+
+#ifdef _OPENMP
+        omp_set_num_threads(omp_get_num_procs());
+#endif
+        SEXP var_pred = R_NilValue;
+        if (A_pred.rows() > 0)
+            var_pred = Rcpp::wrap(chol_QQ.Qinv_diag(SparseMatrix<double, Eigen::RowMajor>(A_pred), std::max(batch_size, 1)));
+        return Rcpp::List::create(
+            Rcpp::Named("W")        = chol_QQ.Qinv_diag(),
+            Rcpp::Named("A_pred")   = var_pred,
+            Rcpp::Named("W_sizes")  = W_sizes
+        );
+    } catch (const char* msg) {
+        Rcpp::stop(std::string(msg) + ": " + file);
+    }
+    return R_NilValue;
+}
+
+// [[Rcpp::export]]
+Rcpp::List load_model_cpp(std::string file) {
+    try {
+        ModelFile m (file);
+
+        Rcpp::List latents;
+        int n_latent = m.iscalar("n_latent");
+        for (int i=0; i < n_latent; i++)
+            latents.push_back(read_model_latent(m, "latent" + std::to_string(i + 1) + "/"));
+
+        SEXP X = m.is_sparse("X") ? Rcpp::wrap(SparseMatrix<double>(m.sparse("X")))
+                                  : Rcpp::wrap(MatrixXd(m.matrix("X")));
+        return Rcpp::List::create(
+            Rcpp::Named("version")  = (int) m.get_version(),
+            Rcpp::Named("noise")    = Rcpp::List::create(
+                Rcpp::Named("noise_type")   = m.string("family"),
+                Rcpp::Named("theta_mu")     = VectorXd(m.vector("theta_mu")),
+                Rcpp::Named("theta_sigma")  = VectorXd(m.vector("theta_sigma")),
+                Rcpp::Named("theta_V")      = m.scalar("theta_V"),
+                Rcpp::Named("V")            = VectorXd(m.vector("V"))
+            ),
+            Rcpp::Named("beta")     = VectorXd(m.vector("beta")),
+            Rcpp::Named("Y")        = VectorXd(m.vector("Y")),
+            Rcpp::Named("X")        = X,
+            Rcpp::Named("A")        = SparseMatrix<double>(m.sparse("A")),
+            Rcpp::Named("K")        = SparseMatrix<double>(m.sparse("K")),
+            Rcpp::Named("latents")  = latents
+        );
+    } catch (const char* msg) {
+        Rcpp::stop(std::string(msg) + ": " + file);
+    }
+    return R_NilValue;
 }
 
 /*
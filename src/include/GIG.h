@@ -67,4 +67,15 @@ db_EiV_GIG(p, a, b)
 
 */
 double db_EiV_GIG(double , double , double ); 
+
+/*
+EV_EiV_GIG(p, a, b, EV, EiV)
+    computes E[V] and E[V^-1] elementwise where V_i ~ GIG(p_i, a_i, b_i),
+    using one Bessel ratio K_{p+1}(sqrt(ab)) / K_p(sqrt(ab)) per element.
+*/
+void EV_EiV_GIG(const Eigen::VectorXd &,
+                const Eigen::VectorXd &,
+                const Eigen::VectorXd &,
+                Eigen::VectorXd &,
+                Eigen::VectorXd &);
 #endif 
\ No newline at end of file
@@ -70,12 +70,32 @@ void read_MatrixXd(MatrixXd&,std::string,std::string);
 SparseMatrix<double,0,int> Qinv2(SparseMatrix<double,0,int>& L);
 
 SparseMatrix<double,0,int> kronecker(SparseMatrix<double,0,int>&,SparseMatrix<double,0,int>&);
+// (A kron B) x without forming A kron B, x is stacked in blocks of size B.cols()
+VectorXd kron_matvec(const SparseMatrix<double,0,int>&, const SparseMatrix<double,0,int>&, const VectorXd&);
 void setSparseBlock(SparseMatrix<double,0,int>*,int, int, SparseMatrix<double,0,int>&);
 void setSparseBlock_update(SparseMatrix<double,0,int>*,int, int, SparseMatrix<double,0,int>&);
 
 //convert a full matrix to sparse format
 SparseMatrix<double,0,int> full2sparse(MatrixXd&);
 
+/*
+	diag(B * S * B'), S is only accessed on the pattern of B'B
+	(so S can be a selected inverse)
+*/
+VectorXd diag_BSBt(const SparseMatrix<double,0,int>&, const SparseMatrix<double,0,int>&);
+
+/*
+	G = X' diag(w) X for w >= 0, accumulated over blocks of rows
+	(in parallel if openmp is available), G is resized if needed
+*/
+void weighted_gram(const MatrixXd&, const VectorXd&, MatrixXd&);
+
+/*
+	connected components of the graph of a symmetric sparse matrix,
+	label(i) in 0..n_comp-1, returns n_comp
+*/
+int connected_components(const SparseMatrix<double,0,int>&, VectorXi&);
+
 // Computing the expectation of
 // (x-m)(x-m)' when x ~  N(mu, Sigma)
 Eigen::MatrixXd NormalOuterExpectation(const Eigen::MatrixXd &,
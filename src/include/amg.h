@@ -0,0 +1,79 @@
+#ifndef __Solver__AMG__
+#define __Solver__AMG__
+#include <vector>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+
+/*
+	Smoothed aggregation AMG, used as the preconditioner of ConjugateGradient.
+	analyzePattern builds the aggregates (and so the patterns of the prolongators
+	and coarse operators) once; factorize only refreshes the smoothed prolongators,
+	the coarse operators and the coarsest Cholesky, e.g. when kappa changes.
+	solve applies one symmetric V-cycle with damped Jacobi smoothing.
+*/
+class AMGPreconditioner
+{
+	typedef Eigen::SparseMatrix<double, 0, int> SpMat;
+
+	struct Level
+	{
+		SpMat A;		   // operator on this level
+		SpMat P0;		   // tentative prolongator from the aggregates
+		SpMat P, Pt;	   // smoothed prolongator and restriction
+		Eigen::VectorXd inv_diag;
+	};
+
+	std::vector<Level> levels;
+	SpMat coarse_A;
+	Eigen::SimplicialLDLT<SpMat> coarse_solver;
+	bool initialized;
+	int max_levels, coarse_size, n_smooth;
+	double omega;
+	Eigen::ComputationInfo m_info;
+
+	int aggregate(const SpMat &A, SpMat &P0) const;
+	void coarsen(Level &L, SpMat &A_next) const;
+	void analyze_impl(const SpMat &A);
+	void factorize_impl(const SpMat &A);
+	void vcycle(int l, const Eigen::MatrixXd &b, Eigen::MatrixXd &x) const;
+
+public:
+	typedef double Scalar;
+	typedef Eigen::VectorXd Vector;
+
+	AMGPreconditioner() : initialized(false), max_levels(10), coarse_size(200), n_smooth(2), omega(2.0 / 3), m_info(Eigen::Success) {}
+
+	template <typename MatType>
+	explicit AMGPreconditioner(const MatType &A) : AMGPreconditioner() { compute(A); }
+
+	template <typename MatType>
+	AMGPreconditioner &analyzePattern(const MatType &A)
+	{
+		analyze_impl(SpMat(A));
+		return *this;
+	}
+	template <typename MatType>
+	AMGPreconditioner &factorize(const MatType &A)
+	{
+		SpMat M(A);
+		if (!initialized)
+			analyze_impl(M);
+		factorize_impl(M);
+		return *this;
+	}
+	template <typename MatType>
+	AMGPreconditioner &compute(const MatType &A)
+	{
+		analyzePattern(A);
+		return factorize(A);
+	}
+
+	Eigen::VectorXd solve(const Eigen::VectorXd &b) const;
+	// one V-cycle for each column of b, sharing the products with the level operators
+	Eigen::MatrixXd solve(const Eigen::MatrixXd &b) const;
+	Eigen::ComputationInfo info() { return m_info; }
+	int n_levels() const { return levels.size() + 1; }
+};
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef NGME_AUTODIFF
+#define NGME_AUTODIFF
+
+#include <Eigen/Sparse>
+#include <unsupported/Eigen/AutoDiff>
+
+// forward-mode dual numbers, one derivative slot per theta_K
+typedef Eigen::AutoDiffScalar<Eigen::VectorXd>          ADScalar;
+typedef Eigen::Matrix<ADScalar, Eigen::Dynamic, 1>      ADVector;
+typedef Eigen::SparseMatrix<ADScalar, 0, int>           ADSparseMatrix;
+
+// theta as independent variables: d theta_i / d theta_j = delta_ij
+inline ADVector ad_seed(const Eigen::VectorXd& theta) {
+    ADVector x (theta.size());
+    for (int i=0; i < theta.size(); i++)
+        x(i) = ADScalar(theta(i), theta.size(), i);
+    return x;
+}
+
+// d K / d theta_i on the pattern of K
+// (entries built only from constants carry no derivative vector)
+inline Eigen::SparseMatrix<double, 0, int> ad_derivative(const ADSparseMatrix& K, int i) {
+    return K.unaryExpr([i](const ADScalar& x) {
+        return x.derivatives().size() > i ? x.derivatives()(i) : 0.0;
+    });
+}
+
+inline Eigen::SparseMatrix<double, 0, int> ad_value(const ADSparseMatrix& K) {
+    return K.unaryExpr([](const ADScalar& x) { return x.value(); });
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __Solver__Basis__
+#define __Solver__Basis__
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::SparseMatrix;
+
+/*
+	n * p basis of a parameter field, e.g. mu = B_mu theta_mu.
+	Stored as a constant (single column with one repeated value, the stationary case),
+	sparse (e.g. local splines) or dense matrix.
+*/
+class Basis
+{
+private:
+	enum Basis_type
+	{
+		basis_constant,
+		basis_sparse,
+		basis_dense
+	} type;
+	int n, p;
+	double c; // the value of the constant column
+	SparseMatrix<double> S;
+	MatrixXd D;
+
+public:
+	Basis() : type(basis_dense), n(0), p(0), c(0) {}
+	Basis(const MatrixXd &B) { set(B); }
+
+	// pick the representation, sparse if less than sparse_ratio of the entries are non-zero
+	void set(const MatrixXd &B, double sparse_ratio = 0.1);
+
+	int rows() const { return n; }
+	int cols() const { return p; }
+	bool is_constant() const { return type == basis_constant; }
+	bool is_sparse() const { return type == basis_sparse; }
+
+	// B theta, T is double or a dual number
+	template <typename T>
+	Eigen::Matrix<T, Eigen::Dynamic, 1> times(const Eigen::Matrix<T, Eigen::Dynamic, 1> &theta) const
+	{
+		if (type == basis_constant)
+			return Eigen::Matrix<T, Eigen::Dynamic, 1>::Constant(n, c * theta(0));
+		else if (type == basis_sparse)
+			return S.cast<T>() * theta;
+		return D.cast<T>() * theta;
+	}
+	VectorXd times(const VectorXd &theta) const;
+
+	// B^T v
+	VectorXd t_times(const VectorXd &v) const;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __Solver__ELLMatrix__
+#define __Solver__ELLMatrix__
+#include <vector>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+using Eigen::VectorXd;
+using Eigen::SparseMatrix;
+
+/*
+	Row-structured sparse matrix with exactly k entries per row (ELLPACK),
+	rows with fewer entries are padded with zero weights.
+	Used for observation matrices (indicator k = 1, barycentric k = 3).
+*/
+class ELLMatrix
+{
+private:
+	int nrow, ncol, k;
+	std::vector<int> col;      // nrow * k
+	std::vector<double> val;   // nrow * k
+	std::vector<int> gram_pos; // nrow * k * k, positions in valuePtr() of the gram pattern
+
+public:
+	ELLMatrix() : nrow(0), ncol(0), k(0) {}
+
+	// returns false (and stays empty) if a row has more than max_k entries
+	bool compress(const SparseMatrix<double> &A, int max_k = 4);
+	int get_k() const { return k; }
+
+	VectorXd times(const VectorXd &x) const;   // A x
+	VectorXd t_times(const VectorXd &y) const; // A^T y
+
+	// full symmetric pattern of A^T A, fixes the positions used by weighted_gram
+	void gram_pattern(SparseMatrix<double> &G);
+	// G = A^T diag(w) A, G must come from gram_pattern
+	void weighted_gram(const VectorXd &w, SparseMatrix<double> &G) const;
+};
+
+#endif
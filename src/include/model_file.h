@@ -0,0 +1,124 @@
+#ifndef NGME_MODEL_FILE
+#define NGME_MODEL_FILE
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include "serialize.h"
+
+/*
+	Versioned binary file of a fitted model (parameters, operators, W/V, orderings).
+
+	Layout (native endianness, checked by a byte order mark):
+		header   magic "NGMEMODL", uint32 version, uint32 byte order mark, uint64 n_entries, uint64 toc offset
+		payload  the arrays, each starting at a multiple of 8 bytes
+		toc      per entry: name, uint32 type, int64 rows, int64 cols, uint64 offset, uint64 bytes
+
+	Entries are found by name ("beta", "latent1/K", ...), so adding fields does not
+	break older readers. A sparse matrix "M" is stored in compressed column form as
+	the entries "M/outer", "M/inner" and "M/values".
+*/
+const char MODEL_FILE_MAGIC[8] = {'N', 'G', 'M', 'E', 'M', 'O', 'D', 'L'};
+const uint32_t MODEL_FILE_VERSION = 1;
+const uint32_t MODEL_FILE_BOM = 0x01020304;
+
+enum Model_entry_type {
+	entry_double, entry_int, entry_string, entry_sparse
+};
+
+struct ModelEntry
+{
+	uint32_t type;
+	int64_t rows, cols;
+	uint64_t offset, bytes;
+};
+
+class ModelFileWriter
+{
+private:
+	std::string payload;
+	std::vector<std::pair<std::string, ModelEntry>> toc;
+
+	void add_entry(const std::string &name, Model_entry_type type, int64_t rows, int64_t cols, const void *p, size_t bytes);
+
+public:
+	void add(const std::string &name, double x) { add_entry(name, entry_double, 1, 1, &x, sizeof(double)); }
+	void add(const std::string &name, int x) { add_entry(name, entry_int, 1, 1, &x, sizeof(int)); }
+	void add(const std::string &name, const std::string &s) { add_entry(name, entry_string, s.size(), 1, s.data(), s.size()); }
+	void add(const std::string &name, const Eigen::VectorXd &v) { add_entry(name, entry_double, v.size(), 1, v.data(), sizeof(double) * v.size()); }
+	void add(const std::string &name, const Eigen::VectorXi &v) { add_entry(name, entry_int, v.size(), 1, v.data(), sizeof(int) * v.size()); }
+	void add(const std::string &name, const Eigen::MatrixXd &m) { add_entry(name, entry_double, m.rows(), m.cols(), m.data(), sizeof(double) * m.size()); }
+	void add(const std::string &name, const Eigen::SparseMatrix<double, 0, int> &M);
+
+	// header + payload + toc
+	std::string release();
+};
+
+// read-only mapping of a whole file (a plain read where mmap is not available)
+class MappedFile
+{
+private:
+	const char *p;
+	size_t n;
+	std::string buf;
+	bool mapped;
+
+public:
+	MappedFile() : p(nullptr), n(0), mapped(false) {}
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool open(const std::string &path);
+	void close();
+	const char *data() const { return p; }
+	size_t size() const { return n; }
+};
+
+/*
+	Reader of a model file. The arrays are views into the mapping (no copy),
+	they are valid as long as the ModelFile is alive.
+*/
+class ModelFile
+{
+private:
+	MappedFile file;
+	uint32_t version;
+	std::map<std::string, ModelEntry> toc;
+
+	// throws if the entry is missing, or its shape does not match its bytes and the file size
+	const ModelEntry &entry(const std::string &name, Model_entry_type type) const;
+
+public:
+	ModelFile(const std::string &path);
+
+	uint32_t get_version() const { return version; }
+	bool has(const std::string &name) const { return toc.count(name) > 0; }
+	bool is_sparse(const std::string &name) const { return has(name) && toc.at(name).type == entry_sparse; }
+	std::vector<std::string> names() const;
+
+	Eigen::Map<const Eigen::MatrixXd> matrix(const std::string &name) const;
+	Eigen::Map<const Eigen::VectorXd> vector(const std::string &name) const;
+	Eigen::Map<const Eigen::VectorXi> ivector(const std::string &name) const;
+	Eigen::Map<const Eigen::SparseMatrix<double, 0, int>> sparse(const std::string &name) const;
+	std::string string(const std::string &name) const;
+	double scalar(const std::string &name) const
+	{
+		Eigen::Map<const Eigen::VectorXd> v = vector(name);
+		if (v.size() != 1)
+			throw("malformed entry in the model file");
+		return v(0);
+	}
+	int iscalar(const std::string &name) const
+	{
+		Eigen::Map<const Eigen::VectorXi> v = ivector(name);
+		if (v.size() != 1)
+			throw("malformed entry in the model file");
+		return v(0);
+	}
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef NGME_SERIALIZE
+#define NGME_SERIALIZE
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <random>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+/*
+	Binary (de)serialization of the chain state, native endianness.
+	Sizes are written as int64 before every vector / matrix / string.
+*/
+class BinaryWriter
+{
+private:
+	std::string buf;
+
+public:
+	template <typename T>
+	void write(const T &x)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "write needs a trivially copyable type");
+		buf.append(reinterpret_cast<const char *>(&x), sizeof(T));
+	}
+	void write_raw(const void *p, size_t n) { buf.append(static_cast<const char *>(p), n); }
+
+	void write(const std::string &s)
+	{
+		write<int64_t>(s.size());
+		buf.append(s);
+	}
+	void write(const Eigen::VectorXd &v)
+	{
+		write<int64_t>(v.size());
+		write_raw(v.data(), sizeof(double) * v.size());
+	}
+	void write(const Eigen::VectorXi &v)
+	{
+		write<int64_t>(v.size());
+		write_raw(v.data(), sizeof(int) * v.size());
+	}
+	void write(const Eigen::MatrixXd &m)
+	{
+		write<int64_t>(m.rows());
+		write<int64_t>(m.cols());
+		write_raw(m.data(), sizeof(double) * m.size());
+	}
+	// the textual state of the engine (the portable form the standard defines)
+	void write(const std::mt19937 &rng)
+	{
+		std::ostringstream os;
+		os << rng;
+		write(os.str());
+	}
+
+	const std::string &data() const { return buf; }
+	std::string release() { return std::move(buf); }
+};
+
+class BinaryReader
+{
+private:
+	const char *p, *end;
+
+	void take(void *dst, size_t n)
+	{
+		if (n > (size_t)(end - p))
+			throw("checkpoint is truncated");
+		std::memcpy(dst, p, n);
+		p += n;
+	}
+	// r * c elements of size bytes must be left, checked before any allocation
+	void check_size(int64_t r, int64_t c, size_t size) const
+	{
+		uint64_t left = (end - p) / size;
+		if (r < 0 || c < 0 || (c > 0 && (uint64_t)r > left / (uint64_t)c))
+			throw("checkpoint is truncated");
+	}
+
+public:
+	BinaryReader(const std::string &buf) : p(buf.data()), end(buf.data() + buf.size()) {}
+
+	template <typename T>
+	void read(T &x)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "read needs a trivially copyable type");
+		take(&x, sizeof(T));
+	}
+	template <typename T>
+	T read()
+	{
+		T x;
+		read(x);
+		return x;
+	}
+	void read_raw(void *dst, size_t n) { take(dst, n); }
+
+	void read(std::string &s)
+	{
+		int64_t n = read<int64_t>();
+		if (n < 0 || n > end - p)
+			throw("checkpoint is truncated");
+		s.assign(p, n);
+		p += n;
+	}
+	void read(Eigen::VectorXd &v)
+	{
+		int64_t n = read<int64_t>();
+		check_size(n, 1, sizeof(double));
+		v.resize(n);
+		take(v.data(), sizeof(double) * v.size());
+	}
+	void read(Eigen::VectorXi &v)
+	{
+		int64_t n = read<int64_t>();
+		check_size(n, 1, sizeof(int));
+		v.resize(n);
+		take(v.data(), sizeof(int) * v.size());
+	}
+	void read(Eigen::MatrixXd &m)
+	{
+		int64_t r = read<int64_t>();
+		int64_t c = read<int64_t>();
+		check_size(r, c, sizeof(double));
+		m.resize(r, c);
+		take(m.data(), sizeof(double) * m.size());
+	}
+	void read(std::mt19937 &rng)
+	{
+		std::string s;
+		read(s);
+		std::istringstream is(s);
+		is >> rng;
+	}
+};
+
+// read a whole file, false if it can not be opened
+bool read_file(const std::string &path, std::string &buf);
+
+/*
+	Writes buffers to path from a background thread, so the sampler only pays for the snapshot.
+	The file is replaced atomically (path.tmp, then rename). A buffer that is still
+	waiting when a newer one is submitted is dropped; close() (or the destructor) writes the last one.
+	The worker does not report failed writes, it keeps them for the owner (take_error).
+*/
+class AsyncFileWriter
+{
+private:
+	std::string path, pending;
+	std::string error;	// first failed write since the last take_error, guarded by m
+	bool has_pending, stop;
+	std::mutex m;
+	std::condition_variable cv;
+	std::thread worker;
+
+	void run();
+
+public:
+	AsyncFileWriter(const std::string &path);
+	~AsyncFileWriter();
+	void submit(std::string &&buf);
+	// write the last buffer and stop the worker
+	void close();
+	// the failed write (empty if none) since the last call
+	std::string take_error();
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __Solver__SLQ__
+#define __Solver__SLQ__
+#include <cmath>
+#include <Eigen/Dense>
+
+/*
+	Stochastic Lanczos quadrature estimate of log|A| for SPD A, matrix-free:
+		log|A| = tr(log A) ~ n / N * sum_i sum_k tau_ik^2 log(theta_ik)
+	where theta, tau are the Ritz values and first components of the eigenvectors
+	of the Lanczos tridiagonal started from probe i / |probe i|.
+	Av(v) returns A v, probes are n * N (e.g. Rademacher), depth is the number of Lanczos steps.
+	Keeping the probes fixed makes the estimate a smooth function of A (for finite differences).
+*/
+template <typename MatVec>
+double slq_logdet(MatVec &&Av, const Eigen::MatrixXd &probes, int depth)
+{
+	const int n = probes.rows();
+	const int N = probes.cols();
+	depth = std::min(depth, n);
+
+	double est = 0;
+	for (int i = 0; i < N; i++)
+	{
+		Eigen::VectorXd alpha(depth), beta(depth);
+		Eigen::VectorXd v = probes.col(i).normalized();
+		Eigen::VectorXd v_prev = Eigen::VectorXd::Zero(n);
+		double b = 0;
+		int m = 0;
+		for (; m < depth; m++)
+		{
+			Eigen::VectorXd w = Av(v);
+			alpha(m) = v.dot(w);
+			w -= alpha(m) * v + b * v_prev;
+			b = w.norm();
+			beta(m) = b;
+			if (b < 1e-12 * std::abs(alpha(m)))
+			{
+				m++;
+				break;
+			}
+			v_prev = v;
+			v = w / b;
+		}
+
+		Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig;
+		Eigen::VectorXd sub = beta.head(std::max(m - 1, 0));
+		eig.computeFromTridiagonal(alpha.head(m), sub, Eigen::ComputeEigenvectors);
+		Eigen::VectorXd tau = eig.eigenvectors().row(0).transpose();
+		est += tau.cwiseProduct(tau).dot(eig.eigenvalues().array().log().matrix());
+	}
+	return est * n / N;
+}
+
+#endif
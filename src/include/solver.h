@@ -7,6 +7,7 @@
 #include <Eigen/LU>
 #include <Eigen/Sparse>
 #include "MatrixAlgebra.h"
+#include "amg.h"
 #include <Rcpp.h>
 
 class solver
@@ -48,7 +49,9 @@ private:
   int N;
   Eigen::MatrixXd U, QU, MQU, MU;
   bool QU_computed;
-  Eigen::ConjugateGradient<Eigen::SparseMatrix<double, 0, int>, Lower|Upper > R;
+  // CG preconditioned by smoothed aggregation AMG, the aggregates are kept between compute() calls
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double, 0, int>, Lower|Upper, AMGPreconditioner> R;
+  Eigen::SparseMatrix<double, 0, int> Q;
 
 public:
   ~iterative_solver(){};
@@ -57,6 +60,8 @@ public:
   inline void analyze(Eigen::SparseMatrix<double, 0, int> &M) { R.analyzePattern(M); }
   void compute(Eigen::SparseMatrix<double, 0, int> &);
   inline Eigen::VectorXd solve(Eigen::VectorXd &v, Eigen::VectorXd &x) { return R.solveWithGuess(v, x); }
+  // CG on all columns of B at once (one SpMM per iteration, converged columns are dropped)
+  Eigen::MatrixXd solve_block(const Eigen::MatrixXd &B, const Eigen::MatrixXd &X0);
   double trace(Eigen::MatrixXd &);
   double trace(Eigen::SparseMatrix<double, 0, int> &);
   double trace2(SparseMatrix<double, 0, int> &, SparseMatrix<double, 0, int> &);
@@ -97,8 +102,14 @@ public:
     return ld;
   }
   VectorXd Qinv_diag();
+  // diag(B Q^-1 B^T), from the selected inverse where it covers the rows of B
+  VectorXd Qinv_diag(const SparseMatrix<double, Eigen::RowMajor> &B, int batch_size);
   Eigen::VectorXd rMVN(Eigen::VectorXd &, Eigen::VectorXd &);
   SparseMatrix<double, 0, int> return_Qinv();
+  // L^-1 P B, so that diag(B^T Q^-1 B) is the squared column norms
+  inline Eigen::MatrixXd solve_L(const Eigen::MatrixXd &B) { return R.matrixL().solve(R.permutationP() * B); }
+  // fill-reducing ordering found by analyze
+  inline Eigen::VectorXi ordering() const { return R.permutationP().indices(); }
 };
 
 
@@ -151,6 +162,9 @@ public:
   inline Eigen::VectorXd solve(Eigen::VectorXd &v, Eigen::VectorXd &x) { return LU_K.solve(v); }
   inline Eigen::VectorXd solve(Eigen::VectorXd &v) { return LU_K.solve(v); }
   inline Eigen::VectorXd solve(Eigen::VectorXd v) { return LU_K.solve(v); }
+  // LU of K only, for repeated (multi-RHS) solves
+  inline void factorizeLU(Eigen::SparseMatrix<double, 0, int> &K_in) { K = K_in; K.makeCompressed(); LU_K.factorize(K); }
+  inline Eigen::MatrixXd solve_multi(const Eigen::MatrixXd &B) { return LU_K.solve(B); }
   double logdet();
   Eigen::VectorXd rMVN(Eigen::VectorXd &, Eigen::VectorXd &)
   {
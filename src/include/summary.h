@@ -0,0 +1,56 @@
+#ifndef NGME_SUMMARY
+#define NGME_SUMMARY
+
+#include <vector>
+#include <Eigen/Dense>
+
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+
+/*
+	Element-wise streaming summary of draws x_1, x_2, ... of a vector of length n:
+	mean and variance (Welford), quantiles at probs (P^2 algorithm of Jain & Chlamtac,
+	5 markers per element and level) and P(x > threshold). Memory is O(n), independent
+	of the number of draws.
+*/
+class PosteriorSummary
+{
+private:
+	int n, n_draws;
+	VectorXd probs, thresholds;
+
+	VectorXd mu, M2;
+	Eigen::MatrixXi exceed;		// n * n_thresholds counts
+
+	// P^2 markers of element i, level k at [(k * n + i) * 5, ... + 5)
+	std::vector<double> q;		// heights
+	std::vector<int> pos;		// actual positions
+	std::vector<double> desired; // desired positions, the same for all elements: [k * 5, ... + 5)
+
+	void add_quantile(int k, int i, double x);
+	void add_quantiles(const VectorXd &x); // n_draws already counts x
+	VectorXd raw_draw(int r) const;			// r-th draw, while n_draws < 5
+
+public:
+	PosteriorSummary() : n(0), n_draws(0) {}
+	PosteriorSummary(int n, const VectorXd &probs, const VectorXd &thresholds) { init(n, probs, thresholds); }
+
+	void init(int n, const VectorXd &probs, const VectorXd &thresholds);
+	void add(const VectorXd &x);
+
+	// combine with the summary of another chain: exact for the moments and the
+	// exceedance, the quantile markers are averaged weighted by the number of draws
+	void merge(const PosteriorSummary &other);
+
+	int size() const { return n; }
+	int draws() const { return n_draws; }
+	const VectorXd &get_probs() const { return probs; }
+	const VectorXd &get_thresholds() const { return thresholds; }
+
+	const VectorXd &mean() const { return mu; }
+	VectorXd variance() const;
+	MatrixXd quantiles() const;	 // n * n_probs
+	MatrixXd exceedance() const; // n * n_thresholds
+};
+
+#endif
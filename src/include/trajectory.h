@@ -0,0 +1,86 @@
+#ifndef __Solver__Trajectory__
+#define __Solver__Trajectory__
+#include <vector>
+#include <string>
+#include <fstream>
+#include <Eigen/Dense>
+#include "serialize.h"
+
+using Eigen::VectorXd;
+
+/*
+	Columnar parameter trajectory, one row per recorded iteration.
+	Preallocated for the expected number of rows, keeps every thin-th call,
+	optionally in float32, and optionally streams the rows (row-major, native
+	endianness) to a binary file instead of keeping them in memory.
+
+	Usage: if (traj.begin_row()) { traj.set(0, x); traj.set(x.size(), y); traj.end_row(); }
+*/
+class Trajectory
+{
+private:
+	int n_col, thin, n_calls, n_rows, capacity;
+	bool single, streaming;
+	std::vector<double> data_d; // column-major, capacity * n_col
+	std::vector<float> data_f;
+	std::vector<double> row_d;  // current row when streaming
+	std::vector<float> row_f;
+	std::string file;
+	std::ofstream sink;
+
+	void grow();
+
+public:
+	Trajectory() : n_col(0), thin(1), n_calls(0), n_rows(0), capacity(0), single(false), streaming(false) {}
+	Trajectory(const Trajectory &) = delete;
+
+	// n_expected: number of calls to begin_row, an empty file keeps the rows in memory,
+	// append keeps the rows already in the file (resuming from a checkpoint)
+	void init(int n_col, int n_expected, int thin = 1, bool single = false, const std::string &file = "", bool append = false);
+
+	// false if this call is thinned out
+	bool begin_row()
+	{
+		return (n_calls++ % thin) == 0;
+	}
+	void set(int j, double x)
+	{
+		if (streaming)
+		{
+			if (single) row_f[j] = x;
+			else row_d[j] = x;
+			return;
+		}
+		if (n_rows == capacity) grow();
+		if (single) data_f[(size_t)j * capacity + n_rows] = x;
+		else data_d[(size_t)j * capacity + n_rows] = x;
+	}
+	void set(int j, const VectorXd &x)
+	{
+		for (int i = 0; i < x.size(); i++)
+			set(j + i, x(i));
+	}
+	void end_row();
+
+	int rows() const { return n_rows; }
+	int cols() const { return n_col; }
+	bool is_single() const { return single; }
+	bool is_streaming() const { return streaming; }
+	const std::string &get_file() const { return file; }
+
+	// copy the recorded rows into a column-major rows() * cols() array (e.g. an R matrix)
+	void copy_to(double *dst) const;
+
+	// push the streamed rows to the file (before a checkpoint records n_rows)
+	void flush()
+	{
+		if (streaming) sink.flush();
+	}
+
+	// checkpointing, a streamed file is cut back to the saved rows on load
+	// (an error if it has fewer rows than the checkpoint)
+	void save(BinaryWriter &out) const;
+	void load(BinaryReader &in);
+};
+
+#endif
@@ -26,15 +26,19 @@ Latent::Latent(const Rcpp::List& model_list, unsigned long seed) :
     h             (Rcpp::as< VectorXd >                     (model_list["h"])), //same length as V_size
     A             (Rcpp::as< SparseMatrix<double,0,int> >   (model_list["A"])),
 
-    var           (Var(Rcpp::as<Rcpp::List> (model_list["noise"]), latent_rng())),
-
-    theta_K_traj  (theta_K.size())
+    var           (Var(Rcpp::as<Rcpp::List> (model_list["noise"]), latent_rng()))
 {
 if (debug) Rcpp::Rcout << "Begin constructor of latent" << std::endl;
 
     // setting the seed
     // latent_rng.seed(seed);
 
+    // replicates share the same operator block
+    if (model_list.containsElementNamed("n_rep")) {
+        n_rep = Rcpp::as<int> (model_list["n_rep"]);
+        if (n_rep < 1 || W_size % n_rep != 0 || V_size % n_rep != 0) n_rep = 1;
+    }
+
     // read from ngme.model
     fix_flag[latent_fix_theta_K] = Rcpp::as<bool>    (model_list["fix_theta_K"]);
 
@@ -44,21 +48,34 @@ if (debug) Rcpp::Rcout << "Begin constructor of latent" << std::endl;
         numer_grad      = Rcpp::as<bool>        (control_f["numer_grad"]) ;
         eps             = Rcpp::as<double>      (control_f["eps"]) ;
         use_iter_solver = Rcpp::as<bool>        (control_f["use_iter_solver"]);
+        trace_iter      = Rcpp::as<int>         (control_f["trace_iter"]);
+        iter_solver_tol = Rcpp::as<double>      (control_f["iter_solver_tol"]);
+        use_slq         = Rcpp::as<bool>        (control_f["use_slq"]);
+        slq_depth       = Rcpp::as<int>         (control_f["slq_depth"]);
+
+    // draw the probes once, so that the estimate is smooth in theta_K
+    if (use_slq) {
+        int n_probes = Rcpp::as<int> (control_f["slq_probes"]);
+        slq_probes.resize(W_size, n_probes);
+        std::bernoulli_distribution coin (0.5);
+        for (int i=0; i < slq_probes.size(); i++)
+            slq_probes.data()[i] = coin(latent_rng) ? 1.0 : -1.0;
+    }
 
     // construct from ngme.noise
     Rcpp::List noise_in = Rcpp::as<Rcpp::List> (model_list["noise"]);
         fix_flag[latent_fix_theta_mu]     = Rcpp::as<bool>  (noise_in["fix_theta_mu"]);
         fix_flag[latent_fix_theta_sigma]  = Rcpp::as<bool>  (noise_in["fix_theta_sigma"]);
 
-        B_mu     = Rcpp::as< MatrixXd >    (noise_in["B_mu"]);
-        B_sigma  = Rcpp::as< MatrixXd >    (noise_in["B_sigma"]);
+        B_mu.set    (Rcpp::as< MatrixXd >  (noise_in["B_mu"]));
+        B_sigma.set (Rcpp::as< MatrixXd >  (noise_in["B_sigma"]));
         n_theta_mu    =   (B_mu.cols());
         n_theta_sigma =   (B_sigma.cols());
 
         theta_mu = Rcpp::as< VectorXd >    (noise_in["theta_mu"]);
         theta_sigma = Rcpp::as< VectorXd > (noise_in["theta_sigma"]);
-        mu = (B_mu * theta_mu);
-        sigma = (B_sigma * theta_sigma).array().exp();
+        mu = (B_mu.times(theta_mu));
+        sigma = (B_sigma.times(theta_sigma)).array().exp();
 
     const int n_theta_V = 1;
     n_params = n_theta_K + n_theta_mu + n_theta_sigma + n_theta_V;
@@ -71,14 +88,10 @@ if (debug) Rcpp::Rcout << "Begin constructor of latent" << std::endl;
 
     // About noise
     // if (fix_flag[latent_fix_V]) var.fixV();
-    if (var.get_noise_type() == "normal") {
+    if (var.get_type() == noise_normal) {
         fix_flag[latent_fix_theta_mu] = 1; // no mu need
     }
 
-    theta_mu_traj.resize(n_theta_mu);
-    theta_sigma_traj.resize(n_theta_sigma);
-    record_traj();
-
 if (debug) Rcpp::Rcout << "End constructor of latent" << std::endl;
 }
 
@@ -87,13 +100,28 @@ VectorXd Latent::grad_theta_mu() {
     // VectorXd inv_V = V.cwiseInverse();
     // VectorXd prev_inv_V = prevV.cwiseInverse();
 
-    VectorXd prevV = getPrevV();
-    VectorXd V = getV();
-    VectorXd grad (n_theta_mu);
-    for (int l=0; l < n_theta_mu; l++) {
-        grad(l) = (V-h).cwiseProduct(B_mu.col(l).cwiseQuotient(getSV())).dot(K*W - mu.cwiseProduct(V-h));
+    if (var.use_rao_blackwell()) {
+        // (V-h)/V * (KW - mu(V-h)) = KW - h*KW/V - mu*(V - 2h + h^2/V), take E[.|W]
+        const VectorXd& EV = var.getEV();
+        VectorXd EiV = var.getEiV();
+        VectorXd KW = K * W;
+        VectorXd Evh = EV - 2*h + h.cwiseProduct(h).cwiseProduct(EiV);
+        VectorXd inv_sigma2 = sigma.array().pow(-2);
+
+        VectorXd grad = B_mu.t_times(
+            (KW - h.cwiseProduct(KW).cwiseProduct(EiV) - mu.cwiseProduct(Evh)).cwiseProduct(inv_sigma2));
+        double hess = -Evh.dot(inv_sigma2);
+        return grad / hess;
     }
-    double hess = -(prevV-h).cwiseQuotient(getPrevSV()).dot(prevV-h);
+
+    const VectorXd& prevV = getPrevV();
+    const VectorXd& V = getV();
+    VectorXd KW = K*W;
+    // grad(l) = sum B_mu(., l) (V-h) (KW - mu (V-h)) / (sigma^2 V)
+    VectorXd wgt = (V.array()-h.array()) * (KW.array() - mu.array()*(V.array()-h.array()))
+        / (sigma.array().square() * V.array());
+    VectorXd grad = B_mu.t_times(wgt);
+    double hess = -((prevV.array()-h.array()).square() / (sigma.array().square() * prevV.array())).sum();
 
     // return - grad / V_size;
     return grad / hess;
@@ -107,13 +135,22 @@ VectorXd Latent::grad_theta_mu() {
 
 // return the gradient wrt. theta, theta=log(sigma)
 inline VectorXd Latent::grad_theta_sigma() {
-    VectorXd V = getV();
-    VectorXd prevV = getPrevV();
+    const VectorXd& V = getV();
 
     VectorXd result(n_theta_sigma);
     // double msq = (K*W - mu.cwiseProduct(V-h)).cwiseProduct(V.cwiseInverse()).dot(K*W - mu(0)*(V-h));
     // VectorXd vsq = (K*W - mu.cwiseProduct(V-h)).array().pow(2);
-    VectorXd vsq = (K*W - mu.cwiseProduct(V-h)).array().pow(2).matrix().cwiseProduct(V.cwiseInverse());
+    VectorXd KW = K*W;
+    VectorXd vsq;
+    if (var.use_rao_blackwell()) {
+        // (r - mu V)^2 / V with r = KW + mu h, take E[.|W]
+        vsq = (KW.array() + mu.array()*h.array()).square() * var.getEiV().array()
+            - 2 * mu.array() * (KW.array() + mu.array()*h.array())
+            + mu.array().square() * var.getEV().array();
+    } else {
+        vsq = (KW.array() - mu.array()*(V.array()-h.array())).square() / V.array();
+        if (exact_post) vsq.array() += diag_BSBt(K, post_cov).array() / V.array();
+    }
     VectorXd grad (n_theta_sigma);
     // for (int l=0; l < n_theta_sigma; l++) {
     //     VectorXd tmp1 = vsq.cwiseProduct(sigma.array().pow(-2).matrix()) - VectorXd::Constant(V_size, 1);
@@ -122,14 +159,9 @@ inline VectorXd Latent::grad_theta_sigma() {
     // }
 
     // vector manner
-    VectorXd tmp1 = vsq.cwiseProduct(sigma.array().pow(-2).matrix()) - VectorXd::Constant(V_size, 1);
-    grad = B_sigma.transpose() * tmp1;
-
-    VectorXd prev_vsq = (K*prevW - mu.cwiseProduct(prevV-h)).array().pow(2).matrix().cwiseProduct(prevV.cwiseInverse());
-    MatrixXd hess (n_theta_sigma, n_theta_sigma);
-    VectorXd tmp3 = -2*prev_vsq.cwiseProduct(sigma.array().pow(-2).matrix());
+    VectorXd tmp1 = vsq.array() / sigma.array().square() - 1;
+    grad = B_sigma.t_times(tmp1);
 
-    hess = B_sigma.transpose() * tmp3.asDiagonal() * B_sigma;
     result = - 1.0 / V_size * grad;
     // result = hess.llt().solve(grad);
     return result;
@@ -139,22 +171,77 @@ double Latent::function_K(SparseMatrix<double>& K) {
     VectorXd V = getV();
     VectorXd SV = getSV();
 
-    SparseMatrix<double> Q = K.transpose() * SV.cwiseInverse().asDiagonal() * K;
     VectorXd tmp = K * W - mu.cwiseProduct(V-h);
 
-    double l;
+    // extra part of E[tmp^T diag(1/SV) tmp] under W|Y
+    double l = exact_post ? - 0.5 * diag_BSBt(K, post_cov).dot(SV.cwiseInverse()) : 0;
+
+    if (n_rep > 1) {
+        // log|Q| = n_rep * log|K_1^T K_1| - sum(log SV)
+        SparseMatrix<double> K1 = rep_block(K);
+        if (!symmetricK) {
+            SparseMatrix<double> Q1 = K1.transpose() * K1;
+            solver_Q.compute(Q1);
+            l += 0.5 * (n_rep * solver_Q.logdet() - SV.array().log().sum());
+        } else {
+            chol_solver_K.compute(K1);
+            l += n_rep * chol_solver_K.logdet();
+        }
+        return l - 0.5 * tmp.cwiseProduct(SV.cwiseInverse()).dot(tmp);
+    }
+
+    if (use_slq) {
+        VectorXd SV_inv = SV.cwiseInverse();
+        if (!symmetricK) {
+            // log|K^T diag(1/SV) K|, applied as K^T (SV_inv .* (K v))
+            l += 0.5 * slq_logdet([&](const VectorXd& v) -> VectorXd {
+                return K.transpose() * SV_inv.cwiseProduct(K * v);
+            }, slq_probes, slq_depth);
+        } else {
+            l += slq_logdet([&](const VectorXd& v) -> VectorXd {
+                return K * v;
+            }, slq_probes, slq_depth);
+        }
+        return l - 0.5 * tmp.cwiseProduct(SV_inv).dot(tmp);
+    }
+
     if (!symmetricK) {
+        SparseMatrix<double> Q = K.transpose() * SV.cwiseInverse().asDiagonal() * K;
         solver_Q.compute(Q);
-        l = 0.5 * solver_Q.logdet()
+        l += 0.5 * solver_Q.logdet()
                - 0.5 * tmp.cwiseProduct(SV.cwiseInverse()).dot(tmp);
     } else {
         chol_solver_K.compute(K);
-        l = chol_solver_K.logdet()
+        l += chol_solver_K.logdet()
             - 0.5 * tmp.cwiseProduct(SV.cwiseInverse()).dot(tmp);
     }
     return l;
 }
 
+VectorXd Latent::solve_K(const VectorXd& rhs) {
+    if (n_rep == 1) {
+        K.makeCompressed();
+        Eigen::Map<const VectorXd> values (K.valuePtr(), K.nonZeros());
+        bool new_pattern = !LU_solve_K_analyzed || LU_solve_K_values.size() != values.size();
+        if (new_pattern) {
+            LU_solve_K.analyzePattern(K);
+            LU_solve_K_analyzed = true;
+        }
+        if (new_pattern || LU_solve_K_values != values) {
+            LU_solve_K.factorize(K);
+            LU_solve_K_values = values;
+        }
+        return LU_solve_K.solve(rhs);
+    }
+    // columns of B are the replicates
+    int n = W_size / n_rep;
+    SparseMatrix<double, 0, int> K1 = rep_block(K);
+    lu_solver_K.factorizeLU(K1);
+    MatrixXd B = Eigen::Map<const MatrixXd>(rhs.data(), n, n_rep);
+    MatrixXd X = lu_solver_K.solve_multi(B);
+    return Eigen::Map<VectorXd>(X.data(), W_size);
+}
+
 // function_K(params += ( 0,0,eps,0,0) )
 double Latent::function_K(VectorXd& theta_K) {
     SparseMatrix<double> K = getK(theta_K);
@@ -163,20 +250,24 @@ double Latent::function_K(VectorXd& theta_K) {
 }
 
 // numerical gradient for K parameters
+// (through function_K(theta_K), so structured models can evaluate it from their factors)
 VectorXd Latent::numerical_grad() {
-    double val = function_K(K);
+    VectorXd th = theta_K;
+    double val = function_K(th);
     VectorXd grad (n_theta_K);
     // iterate every parameter
     for (int i=0; i < n_theta_K; i++) {
-        SparseMatrix<double> K_add_eps = getK_by_eps(i, eps);
-        double val_add_eps = function_K(K_add_eps);
+        VectorXd th_add_eps = theta_K;
+        th_add_eps(i) += eps;
+        double val_add_eps = function_K(th_add_eps);
         double num_g = (val_add_eps - val) / eps;
 
         if (!use_precond) {
             grad(i) = - num_g / W_size;
         } else {
-            SparseMatrix<double> K_minus_eps = getK_by_eps(i, -eps);
-            double val_minus_eps = function_K(K_minus_eps);
+            VectorXd th_minus_eps = theta_K;
+            th_minus_eps(i) -= eps;
+            double val_minus_eps = function_K(th_minus_eps);
             double num_hess = (val_minus_eps + val_add_eps - 2*val) / pow(eps, 2);
             grad(i) = num_g / num_hess;
         }
@@ -195,13 +286,12 @@ Rcpp::List Latent::output() const {
         Rcpp::Named("V")            = getV(),
         Rcpp::Named("W")            = W
     );
-    Rcpp::List trajecotry = Rcpp::List::create(
-        Rcpp::Named("theta_K")            = theta_K_traj,
-        Rcpp::Named("theta_mu")           = theta_mu_traj,
-        Rcpp::Named("theta_sigma")        = theta_sigma_traj,
-        Rcpp::Named("theta_V")            = theta_V_traj
-    );
-    out.attr("trajectory") = trajecotry;
+    out.attr("trajectory") = trajectory_output(traj, Rcpp::IntegerVector::create(
+        Rcpp::Named("theta_K")      = n_theta_K,
+        Rcpp::Named("theta_mu")     = n_theta_mu,
+        Rcpp::Named("theta_sigma")  = n_theta_sigma,
+        Rcpp::Named("theta_V")      = 1
+    ));
     return out;
 }
 
@@ -233,4 +323,71 @@ Rcpp::List Latent::output() const {
 //     }
 //     // return grad;
 //     return grad;
-// }
\ No newline at end of file
+// }
+
+void Latent::save(BinaryWriter& out) const {
+    out.write(theta_K);
+    out.write(theta_mu);
+    out.write(theta_sigma);
+    out.write(W);
+    out.write(prevW);
+    out.write(latent_rng);
+    var.save(out);
+    traj.save(out);
+}
+
+void Latent::load(BinaryReader& in) {
+    in.read(theta_K);
+    in.read(theta_mu);
+    in.read(theta_sigma);
+    in.read(W);
+    in.read(prevW);
+    in.read(latent_rng);
+    var.load(in);
+    traj.load(in);
+
+    mu = B_mu.times(theta_mu);
+    sigma = B_sigma.times(theta_sigma).array().exp();
+    update_each_iter();
+}
+
+void Latent::write_model(ModelFileWriter& out, const string& prefix) const {
+    out.add(prefix + "model",       model_type);
+    out.add(prefix + "noise_type",  noise_type);
+    out.add(prefix + "n_rep",       n_rep);
+    out.add(prefix + "theta_K",     theta_K);
+    out.add(prefix + "theta_mu",    theta_mu);
+    out.add(prefix + "theta_sigma", theta_sigma);
+    out.add(prefix + "theta_V",     var.get_theta_V());
+    out.add(prefix + "mu",          mu);
+    out.add(prefix + "sigma",       sigma);
+    out.add(prefix + "h",           h);
+    out.add(prefix + "W",           W);
+    out.add(prefix + "V",           getV());
+    out.add(prefix + "K",           K);
+    out.add(prefix + "A",           A);
+
+    // fill-reducing (AMD) ordering of the pattern of K^T K, not every model analyzes chol_solver_K
+    SparseMatrix<double> KtK = K.transpose() * K;
+    Eigen::AMDOrdering<int> amd;
+    Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> P;
+    amd(KtK, P);
+    out.add(prefix + "K/ordering",  Eigen::VectorXi(P.indices()));
+}
+
+std::unique_ptr<Latent> create_latent(Rcpp::List& model_list, unsigned long seed) {
+    string model_type = model_list["model"];
+    int n_theta_K = Rcpp::as<int> (model_list["n_theta_K"]);
+
+    if (model_type == "ar1" || model_type == "rw1")
+        return std::make_unique<AR>(model_list, seed);
+    else if (model_type == "matern" && n_theta_K > 1)
+        return std::make_unique<Matern_ns>(model_list, seed);
+    else if (model_type == "matern")
+        return std::make_unique<Matern>(model_list, seed);
+    else if (model_type == "lattice_matern")
+        return std::make_unique<LatticeMatern>(model_list, seed);
+    else if (model_type == "spacetime")
+        return std::make_unique<Spacetime>(model_list, seed);
+    return nullptr;
+}
@@ -21,9 +21,15 @@
 #include <Eigen/Dense>
 #include <random>
 #include <cmath>
+#include <memory>
 
 #include "include/timer.h"
 #include "include/solver.h"
+#include "include/slq.h"
+#include "include/autodiff.h"
+#include "include/basis.h"
+#include "include/trajectory.h"
+#include "include/model_file.h"
 #include "var.h"
 
 using std::exp;
@@ -42,18 +48,34 @@ enum Latent_fix_flag {
 };
 const int LATENT_FIX_FLAG_SIZE = 4;
 
+// list(values, file, single, sizes) for R, values is the rows * cols matrix (NULL if streamed to file)
+inline Rcpp::List trajectory_output(const Trajectory& traj, const Rcpp::IntegerVector& sizes) {
+    SEXP values = R_NilValue;
+    if (!traj.is_streaming()) {
+        Rcpp::NumericMatrix m (traj.rows(), traj.cols());
+        traj.copy_to(m.begin());
+        values = m;
+    }
+    return Rcpp::List::create(
+        Rcpp::Named("values")   = values,
+        Rcpp::Named("file")     = traj.is_streaming() ? Rcpp::wrap(traj.get_file()) : R_NilValue,
+        Rcpp::Named("single")   = traj.is_single(),
+        Rcpp::Named("sizes")    = sizes
+    );
+}
+
 class Latent {
 protected:
     std::mt19937 latent_rng;
     string model_type, noise_type;
     bool debug;
     int W_size, V_size, n_params, n_var {1}; // n_params=n_theta_K + n_theta_mu + n_theta_sigma + n_var
+    int n_rep {1}; // K = diag(K_1, ..., K_1), n_rep identical blocks
 
     // operator K related
     VectorXd theta_K;
 
-    bool use_num_dK {false};
-    SparseMatrix<double, 0, int> K, dK, d2K;
+    SparseMatrix<double, 0, int> K, dK;
     int n_theta_K;
 
     bool fix_flag[LATENT_FIX_FLAG_SIZE] {0};
@@ -62,7 +84,7 @@ protected:
     bool symmetricK {false};
 
     // mu and sigma
-    MatrixXd B_mu, B_sigma;
+    Basis B_mu, B_sigma;
     VectorXd theta_mu, theta_sigma;
     VectorXd mu, sigma;
     int n_theta_mu, n_theta_sigma;
@@ -78,16 +100,29 @@ protected:
     // solver
     cholesky_solver chol_solver_K;
     lu_sparse_solver lu_solver_K;
+    // LU of K for solve_K (n_rep == 1), the pattern is analyzed once and
+    // K is only refactorized when its values changed
+    Eigen::SparseLU<SparseMatrix<double, 0, int>> LU_solve_K;
+    VectorXd LU_solve_K_values;
+    bool LU_solve_K_analyzed {false};
     bool use_iter_solver {false};
+    int trace_iter {10};        // number of probe vectors for the CG trace estimate
+    double iter_solver_tol {1e-6};
     iterative_solver CG_solver_K;
 
+    // stochastic Lanczos quadrature for log|K| in function_K (no factorization)
+    bool use_slq {false};
+    int slq_depth {30};
+    MatrixXd slq_probes;        // fixed Rademacher probes, shared by all evaluations
+
     cholesky_solver solver_Q; // Q = KT diag(1/SV) K
 
-    // record trajectory
-    vector<vector<double>> theta_K_traj;
-    vector<vector<double>> theta_mu_traj;
-    vector<vector<double>> theta_sigma_traj;
-    vector<double>   theta_V_traj;
+    // posterior covariance of W (exact Gaussian mode), W is then the posterior mean
+    bool exact_post {false};
+    SparseMatrix<double,0,int> post_cov;
+
+    // record trajectory, columns theta_K, theta_mu, theta_sigma, theta_V
+    Trajectory traj;
 public:
     Latent(const Rcpp::List&, unsigned long seed);
     virtual ~Latent() {}
@@ -101,6 +136,18 @@ public:
     int get_W_size() const                  {return W_size; }
     int get_V_size() const                  {return V_size; }
     int get_n_params() const                {return n_params; }
+    int get_n_rep() const                   {return n_rep; }
+
+    // first diagonal block of a replicated operator
+    SparseMatrix<double, 0, int> rep_block(const SparseMatrix<double, 0, int>& M) const {
+        if (n_rep == 1) return M;
+        return M.topLeftCorner(M.rows() / n_rep, M.cols() / n_rep);
+    }
+
+    // K^-1 rhs (square K), one factorization of K_1 is applied to all replicates
+    virtual VectorXd solve_K(const VectorXd& rhs);
+    // whether solve_K is cheaper than factorizing K in the block
+    virtual bool has_solve_K() const { return n_rep > 1; }
     SparseMatrix<double, 0, int>& getA()    {return A; }
 
     const VectorXd& getW()  const           {return W; }
@@ -114,18 +161,31 @@ public:
 
     VectorXd getMean() const { return mu.cwiseProduct(getV()-h); }
 
+    string get_noise_type() const { return noise_type; }
+    Noise_type get_noise_type_id() const { return var.get_type(); }
+
+    // W|Y ~ N(W, cov), cov is the selected inverse of QQ
+    void set_post_cov(const SparseMatrix<double,0,int>& cov) {
+        post_cov = cov; exact_post = true;
+    }
+
+    // E[(dK W)^T diag(1/SV) K W] - (dK W)^T diag(1/SV) K W, 0 if W is sampled
+    double post_trace_dK(const SparseMatrix<double,0,int>& dK) const {
+        if (!exact_post) return 0;
+        SparseMatrix<double,0,int> M = dK.transpose() * getSV().cwiseInverse().asDiagonal() * K;
+        return post_cov.cwiseProduct(M).sum();
+    }
+
     /*  2 Variance component   */
     const VectorXd& getV()     const { return var.getV(); }
     const VectorXd& getPrevV() const { return var.getPrevV(); }
     void setPrevV(const VectorXd& V) { var.setPrevV(V); }
 
     VectorXd getSV() const {
-        VectorXd V = getV();
-        return (sigma.array().pow(2).matrix().cwiseProduct(V));
+        return sigma.array().square() * getV().array();
     }
     VectorXd getPrevSV() const {
-        VectorXd prevV = getPrevV();
-        return (sigma.array().pow(2).matrix().cwiseProduct(prevV));
+        return sigma.array().square() * getPrevV().array();
     }
 
     void sample_V() {
@@ -134,17 +194,47 @@ public:
 
     void sample_cond_V() {
         VectorXd tmp = (K * W + mu.cwiseProduct(h));
-        VectorXd a_inc_vec = mu.cwiseQuotient(sigma).array().pow(2);
-        VectorXd b_inc_vec = tmp.cwiseQuotient(sigma).array().pow(2);
+        VectorXd a_inc_vec = (mu.array() / sigma.array()).square();
+        VectorXd b_inc_vec = (tmp.array() / sigma.array()).square();
         var.sample_cond_V(a_inc_vec, b_inc_vec);
     }
 
+    // E[V|W] and E[1/V|W] given current W (for Rao-Blackwellized gradients)
+    void set_rao_blackwell(bool rb) { var.set_rao_blackwell(rb); }
+    void compute_cond_moments() {
+        if (!var.use_rao_blackwell()) return;
+        VectorXd tmp = (K * W + mu.cwiseProduct(h));
+        VectorXd a_inc_vec = (mu.array() / sigma.array()).square();
+        VectorXd b_inc_vec = (tmp.array() / sigma.array()).square();
+        var.compute_cond_moments(a_inc_vec, b_inc_vec);
+    }
+
     /*  3 Operator component   */
     SparseMatrix<double, 0, int>& getK()    { return K; }
 
     // get K/dK using different parameter
     virtual SparseMatrix<double, 0, int> getK(const VectorXd&) const=0;
-    virtual SparseMatrix<double, 0, int> get_dK(int, const VectorXd&) const=0;
+
+    // K on dual numbers, override it (usually with the same template as getK)
+    // to get exact dK from get_dK without per-model derivative code
+    virtual ADSparseMatrix getK_ad(const ADVector&) const {
+        throw("getK_ad is not implemented for this model");
+    }
+
+    // dK wrt. theta_K[index], by default from one forward-mode pass of getK_ad
+    virtual SparseMatrix<double, 0, int> get_dK(int index, const VectorXd& theta) const {
+        ADSparseMatrix K_ad = getK_ad(ad_seed(theta));
+        return ad_derivative(K_ad, index);
+    }
+
+    // all dK_i from a single pass
+    vector<SparseMatrix<double, 0, int>> get_dK_all(const VectorXd& theta) const {
+        ADSparseMatrix K_ad = getK_ad(ad_seed(theta));
+        vector<SparseMatrix<double, 0, int>> dKs (theta.size());
+        for (int i=0; i < theta.size(); i++)
+            dKs[i] = ad_derivative(K_ad, i);
+        return dKs;
+    }
 
     // variants of getK and get_dK
     // get_dK wrt. paramter_K[i]
@@ -187,48 +277,43 @@ public:
 // compute trace
 // auto timer_trace = std::chrono::steady_clock::now();
 
-        SparseMatrix<double> K = getK(theta_K);
-        SparseMatrix<double> dK = get_dK_by_index(0);
-        if (!use_iter_solver) {
+        // tr(K^-1 dK) = n_rep * tr(K_1^-1 dK_1)
+        SparseMatrix<double> K = rep_block(getK(theta_K));
+        SparseMatrix<double> dK = rep_block(get_dK_by_index(0));
+        if (!use_iter_solver || !symmetricK) {
             if (!symmetricK) {
                 lu_solver_K.computeKTK(K);
-                trace = lu_solver_K.trace(dK);
+                trace = n_rep * lu_solver_K.trace(dK);
             } else {
                 chol_solver_K.compute(K);
-                trace = chol_solver_K.trace(dK);
+                trace = n_rep * chol_solver_K.trace(dK);
             }
+        } else {
+            // Hutchinson estimate with AMG-preconditioned CG solves
+            CG_solver_K.compute(K);
+            trace = n_rep * CG_solver_K.trace(dK);
         }
-// Rcpp::Rcout << "eps K  in 1= " << K << std::endl;
-// Rcpp::Rcout << "eps dK in 1= " << dK << std::endl;
-// Rcpp::Rcout << "trace  in 1= " << trace << std::endl;
-        // else {
-        //     if (!symmetricK) {
-        //         // BiCG solver
-        //         throw("Not implemented yet");
-        //     } else {
-        //         SparseMatrix<double, RowMajor> KK = K;
-        //         CG_solver_K.compute(K);
-        //         trace = CG_solver_K.trace(M);
-        //     }
-        // }
 
 // Rcpp::Rcout << "trace ====== " << trace << std::endl;
 // Rcpp::Rcout << "time for the trace (ms): " << since(timer_trace).count() << std::endl;
 
         // update trace_eps if using hessian
         if ((!numer_grad) && (use_precond)) {
-            SparseMatrix<double> K = getK_by_eps(0, eps);
-            SparseMatrix<double> dK = get_dK_by_eps(0, 0, eps);
+            SparseMatrix<double> K = rep_block(getK_by_eps(0, eps));
+            SparseMatrix<double> dK = rep_block(get_dK_by_eps(0, 0, eps));
             SparseMatrix<double> M = dK;
 
-            if (!use_iter_solver) {
+            if (!use_iter_solver || !symmetricK) {
                 if (!symmetricK) {
                     lu_solver_K.computeKTK(K);
-                    trace_eps = lu_solver_K.trace(M);
+                    trace_eps = n_rep * lu_solver_K.trace(M);
                 } else {
                     chol_solver_K.compute(K);
-                    trace_eps = chol_solver_K.trace(M);
+                    trace_eps = n_rep * chol_solver_K.trace(M);
                 }
+            } else {
+                CG_solver_K.compute(K);
+                trace_eps = n_rep * CG_solver_K.trace(M);
             }
 // Rcpp::Rcout << "eps K  in 2 = " << K << std::endl;
 // Rcpp::Rcout << "eps dK in 2 = " << dK << std::endl;
@@ -255,14 +340,27 @@ public:
     // virtual Rcpp::List get_estimates() const=0;
     Rcpp::List output() const;
 
+    // n_expected records, keep every thin-th, stream to file if not empty
+    void init_traj(int n_expected, int thin, bool single, const string& file, bool append=false) {
+        traj.init(n_theta_K + n_theta_mu + n_theta_sigma + 1, n_expected, thin, single, file, append);
+        record_traj();
+    }
+    void flush_traj() { traj.flush(); }
+
+    // chain state for checkpointing, operators are rebuilt from the restored theta_K
+    void save(BinaryWriter& out) const;
+    void load(BinaryReader& in);
+
+    // fitted model (parameters, operators, W/V) as entries prefix + name
+    void write_model(ModelFileWriter& out, const string& prefix) const;
+
     void record_traj() {
-        for (int i=0; i < theta_K.size(); i++)
-            theta_K_traj[i].push_back(theta_K(i));
-        for (int i=0; i < theta_mu.size(); i++)
-            theta_mu_traj[i].push_back(theta_mu(i));
-        for (int i=0; i < theta_sigma.size(); i++)
-            theta_sigma_traj[i].push_back(theta_sigma(i));
-        theta_V_traj.push_back(var.get_theta_V());
+        if (traj.cols() == 0 || !traj.begin_row()) return;
+        traj.set(0, theta_K);
+        traj.set(n_theta_K, theta_mu);
+        traj.set(n_theta_K + n_theta_mu, theta_sigma);
+        traj.set(n_theta_K + n_theta_mu + n_theta_sigma, var.get_theta_V());
+        traj.end_row();
     }
 };
 
@@ -307,8 +405,8 @@ inline void Latent::set_parameter(const VectorXd& theta) {
     var.set_theta_var   (theta(n_theta_K+n_theta_mu+n_theta_sigma));
 
     // update
-    mu = (B_mu * theta_mu);
-    sigma = (B_sigma * theta_sigma).array().exp();
+    mu = (B_mu.times(theta_mu));
+    sigma = (B_sigma.times(theta_sigma)).array().exp();
     update_each_iter();
 
     // record
@@ -316,18 +414,20 @@ inline void Latent::set_parameter(const VectorXd& theta) {
 }
 
 // subclasses
-class AR : public Latent {
+class AR final : public Latent {
 private:
     SparseMatrix<double, 0, int> G, C;
 public:
     AR(Rcpp::List& model_list, unsigned long seed);
 
-    SparseMatrix<double> getK(const VectorXd& alpha) const;
-    SparseMatrix<double> get_dK(int index, const VectorXd& alpha) const;
+    template <typename T>
+    SparseMatrix<T, 0, int> assembleK(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta_K) const;
+    SparseMatrix<double> getK(const VectorXd& theta_K) const { return assembleK<double>(theta_K); }
+    ADSparseMatrix getK_ad(const ADVector& theta_K) const { return assembleK<ADScalar>(theta_K); }
     VectorXd grad_theta_K();
     void update_each_iter();
-    void update_num_dK();
-    double th2a(double th) const {return (-1 + 2*exp(th) / (1+exp(th)));}
+    template <typename T>
+    T th2a(const T& th) const {return (-1.0 + 2.0*exp(th) / (1.0+exp(th)));}
     double a2th(double k) const {return (log((-1-k)/(-1+k)));}
 
     VectorXd unbound_to_bound_K(const VectorXd& theta_K) const {
@@ -351,19 +451,22 @@ public:
 };
 
 
-class Matern : public Latent {
+class Matern final : public Latent {
 private:
     SparseMatrix<double, 0, int> G, C;
     int alpha;
     VectorXd Cdiag;
 public:
     Matern(Rcpp::List& model_list, unsigned long seed);
-    SparseMatrix<double> getK(const VectorXd& alpha) const;
-    SparseMatrix<double> get_dK(int index, const VectorXd& alpha) const;
+
+    template <typename T>
+    SparseMatrix<T, 0, int> assembleK(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta_K) const;
+    SparseMatrix<double> getK(const VectorXd& theta_K) const { return assembleK<double>(theta_K); }
+    ADSparseMatrix getK_ad(const ADVector& theta_K) const { return assembleK<ADScalar>(theta_K); }
     VectorXd grad_theta_K();
     void update_each_iter();
-    void update_num_dK();
-    double th2k(double th) const {return exp(th);}
+    template <typename T>
+    T th2k(const T& th) const {return exp(th);}
     double k2th(double k) const {return log(k);}
 
     VectorXd unbound_to_bound_K(const VectorXd& theta_K) const {
@@ -386,16 +489,20 @@ public:
     // }
 };
 
-class Matern_ns : public Latent {
+class Matern_ns final : public Latent {
 private:
     SparseMatrix<double, 0, int> G, C;
     int alpha;
-    MatrixXd Bkappa;
+    Basis Bkappa;
     VectorXd Cdiag;
+    cholesky_solver chol_solver_T;  // T = G + kappa^2 C (alpha=4)
 public:
     Matern_ns(Rcpp::List& model_list, unsigned long seed);
-    SparseMatrix<double> getK(const VectorXd& alpha) const;
-    SparseMatrix<double> get_dK(int index, const VectorXd& alpha) const;
+
+    template <typename T>
+    SparseMatrix<T, 0, int> assembleK(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta_K) const;
+    SparseMatrix<double> getK(const VectorXd& theta_K) const;
+    ADSparseMatrix getK_ad(const ADVector& theta_K) const { return assembleK<ADScalar>(theta_K); }
     VectorXd grad_theta_K();
     void update_each_iter();
 
@@ -409,4 +516,89 @@ public:
     // }
 };
 
+// Matern on a periodic nx * ny lattice, K is diagonalized by the 2d DFT
+class LatticeMatern final : public Latent {
+private:
+    int nx, ny, alpha;
+    double h_grid;      // grid spacing, C = h_grid^2 I
+    VectorXd glap;      // eigenvalues of the periodic 5-point Laplacian G
+    VectorXd lambda;    // eigenvalues of K at the current kappa
+    SparseMatrix<double, 0, int> G;
+public:
+    LatticeMatern(Rcpp::List& model_list, unsigned long seed);
+    SparseMatrix<double> getK(const VectorXd& theta_K) const;
+    SparseMatrix<double> get_dK(int index, const VectorXd& theta_K) const;
+    VectorXd eigen_K(double kappa) const;
+    VectorXd eigen_dK(double kappa) const;
+
+    VectorXd grad_theta_K();
+    void update_each_iter();
+
+    using Latent::function_K;
+    double function_K(VectorXd& theta_K);
+
+    VectorXd solve_K(const VectorXd& rhs);
+    bool has_solve_K() const { return true; }
+
+    double th2k(double th) const {return exp(th);}
+    double k2th(double k) const {return log(k);}
+    VectorXd unbound_to_bound_K(const VectorXd& theta_K) const {
+        return VectorXd::Constant(1, th2k(theta_K(0)));
+    }
+    VectorXd bound_to_unbound_K(const VectorXd& kappa) const {
+        return VectorXd::Constant(1, k2th(kappa(0)));
+    }
+};
+
+// AR1 in time kron Matern in space, W is stacked by time
+class Spacetime final : public Latent {
+private:
+    SparseMatrix<double, 0, int> G_t, C_t, G_s, C_s;
+    SparseMatrix<double, 0, int> K_t, K_s, dK_t, dK_s;
+    int alpha;      // spatial smoothness, 2 or 4
+    VectorXd Cdiag_s;
+    int n_t, n_s;
+    VectorXd traces; // tr(K^-1 dK) wrt. theta_K
+
+    lu_sparse_solver lu_t;
+    cholesky_solver chol_s;
+public:
+    Spacetime(Rcpp::List& model_list, unsigned long seed);
+    SparseMatrix<double> getK(const VectorXd& theta_K) const;
+    SparseMatrix<double> get_dK(int index, const VectorXd& theta_K) const;
+    SparseMatrix<double, 0, int> getK_t(double th) const;
+    SparseMatrix<double, 0, int> getK_s(double th) const;
+    SparseMatrix<double, 0, int> get_dK_t(double th) const;
+    SparseMatrix<double, 0, int> get_dK_s(double th) const;
+
+    VectorXd grad_theta_K();
+    void update_each_iter();
+
+    // log-likelihood of K from the factors, log|K| = n_s log|K_t| + n_t log|K_s|
+    using Latent::function_K;
+    double function_K(VectorXd& theta_K);
+
+    VectorXd solve_K(const VectorXd& rhs);
+    bool has_solve_K() const { return true; }
+
+    double th2a(double th) const {return (-1 + 2*exp(th) / (1+exp(th)));}
+    double a2th(double k) const {return (log((-1-k)/(-1+k)));}
+    double th2k(double th) const {return exp(th);}
+    double k2th(double k) const {return log(k);}
+
+    VectorXd unbound_to_bound_K(const VectorXd& theta_K) const {
+        VectorXd par (2);
+        par << th2a(theta_K(0)), th2k(theta_K(1));
+        return par;
+    }
+    VectorXd bound_to_unbound_K(const VectorXd& par) const {
+        VectorXd theta_K (2);
+        theta_K << a2th(par(0)), k2th(par(1));
+        return theta_K;
+    }
+};
+
+// construct the latent model named by model_list["model"], nullptr if unknown
+std::unique_ptr<Latent> create_latent(Rcpp::List& model_list, unsigned long seed);
+
 #endif
\ No newline at end of file
@@ -20,64 +20,49 @@ AR::AR(Rcpp::List& model_list, unsigned long seed)
 {
 if (debug) Rcpp::Rcout << "Begin Constructor of AR1" << std::endl;
 
-    // Init K and Q
+    // Init K and Q, with replicates only the first block is factorized
     K = getK(theta_K);
-    SparseMatrix<double> Q = K.transpose() * K;
+    dK = get_dK_by_index(0);
+    SparseMatrix<double> K1 = rep_block(K);
+    SparseMatrix<double> Q = K1.transpose() * K1;
 
     // watch out!
     if (W_size == V_size) {
-        lu_solver_K.init(W_size, 0,0,0);
-        lu_solver_K.analyze(K);
+        lu_solver_K.init(W_size / n_rep, 0,0,0);
+        lu_solver_K.analyze(K1);
         compute_trace();
     }
 
     // Init Q
-    solver_Q.init(W_size, 0,0,0);
+    solver_Q.init(W_size / n_rep, 0,0,0);
     solver_Q.analyze(Q);
 if (debug) Rcpp::Rcout << "End Constructor of AR1" << std::endl;
 }
 
-// wrt. parameter_K (bounded parameter)
-SparseMatrix<double> AR::getK(const VectorXd& theta_K) const {
+// wrt. theta_K (unbounded), T is double or ADScalar
+template <typename T>
+SparseMatrix<T, 0, int> AR::assembleK(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta_K) const {
     assert (theta_K.size() == 1);
-    double alpha = th2a(theta_K(0));
-    SparseMatrix<double> K = alpha * C + G;
+    T alpha = th2a(theta_K(0));
+    SparseMatrix<T, 0, int> K = alpha * C.cast<T>() + G.cast<T>();
     return K;
 }
 
-SparseMatrix<double> AR::get_dK(int index, const VectorXd& alpha) const {
-    assert(index==0);
-    return C;
-}
-
-// compute numerical dK
-void AR::update_num_dK() {
-    double alpha = th2a(theta_K(0) + eps);
-    SparseMatrix<double> K_add_eps = alpha * C + G;
-    dK = (K_add_eps - K) / eps;
-}
-
-// return length 1 vectorxd : grad_kappa * dkappa/dtheta
+// return length 1 vectorxd, dK = dK/dtheta already contains dalpha/dtheta
 VectorXd AR::grad_theta_K() {
-    SparseMatrix<double> dK = get_dK_by_index(0);
     VectorXd V = getV();
     VectorXd SV = getSV();
 
-    double a = th2a(theta_K(0));
-    double th = a2th(a);
-
-    double da  = 2 * (exp(th) / pow(1+exp(th), 2));
-    double d2a = 2 * (exp(th) * (-1+exp(th)) / pow(1+exp(th), 3));
-
     double ret = 0;
     if (numer_grad) {
         // 1. numerical gradient
         ret = numerical_grad()(0);
     } else {
         // 2. analytical gradient and numerical hessian
-        double tmp = (dK*W).cwiseProduct(SV.cwiseInverse()).dot(K * W + (h - V).cwiseProduct(mu));
+        double tmp = (dK*W).cwiseProduct(SV.cwiseInverse()).dot(K * W + (h - V).cwiseProduct(mu))
+            + post_trace_dK(dK);
         double grad = trace - tmp;
-        ret = - grad * da / W_size;
+        ret = - grad / W_size;
 
     // if (debug) Rcpp::Rcout << "tmp =" << tmp << std::endl;
     // if (debug) Rcpp::Rcout << "trace =" << trace << std::endl;
@@ -117,12 +102,7 @@ VectorXd AR::grad_theta_K() {
 
 void AR::update_each_iter() {
     K = getK(theta_K);
-    dK = get_dK(0, theta_K);
-    d2K = 0 * C;
-
-    if (use_num_dK) {
-        update_num_dK();
-    }
+    dK = get_dK_by_index(0);
 
     if (!numer_grad && (W_size == V_size))
         compute_trace();
@@ -0,0 +1,152 @@
+/*
+    Matern model on a regular periodic lattice:
+        parameter_K(0) = kappa
+        K = kappa^2 C + G,  alpha=2
+            (kappa^2 C + G) C^-1 (kappa^2 C + G),  alpha=4
+        C = h^2 I, G = periodic 5-point Laplacian
+
+    K is block-circulant, with eigenvalues
+        lambda(k1, k2) = kappa^2 h^2 + 4 - 2cos(2 pi k1/nx) - 2cos(2 pi k2/ny)   (squared / h^2 for alpha=4),
+    so solves are diagonal in Fourier space, and logdet and tr(K^-1 dK) are sums over lambda.
+    W(i + nx*j) is the value at cell (i, j).
+*/
+
+#include "../latent.h"
+#include <unsupported/Eigen/FFT>
+
+using Eigen::MatrixXcd;
+using Eigen::VectorXcd;
+
+// in-place 2d DFT of an nx * ny field (inverse is scaled by 1/(nx*ny))
+static void fft2(MatrixXcd& F, bool inverse)
+{
+    Eigen::FFT<double> fft;
+    VectorXcd in, out;
+    for (int j=0; j < F.cols(); j++) {
+        in = F.col(j);
+        if (inverse) fft.inv(out, in); else fft.fwd(out, in);
+        F.col(j) = out;
+    }
+    for (int i=0; i < F.rows(); i++) {
+        in = F.row(i).transpose();
+        if (inverse) fft.inv(out, in); else fft.fwd(out, in);
+        F.row(i) = out.transpose();
+    }
+}
+
+LatticeMatern::LatticeMatern(Rcpp::List& model_list, unsigned long seed)
+: Latent(model_list, seed),
+    nx          (Rcpp::as<int>    (model_list["nx"])),
+    ny          (Rcpp::as<int>    (model_list["ny"])),
+    alpha       (Rcpp::as<int>    (model_list["alpha"])),
+    h_grid      (Rcpp::as<double> (model_list["h_grid"])),
+    glap        (nx * ny),
+    G           (nx * ny, nx * ny)
+{
+if (debug) Rcpp::Rcout << "Begin Constructor of LatticeMatern" << std::endl;
+    symmetricK = true;
+
+    if (nx * ny != W_size || W_size != V_size) {
+        Rcpp::Rcout << "LatticeMatern: W_size should be nx * ny = " << nx * ny << std::endl;
+        throw("wrong dimension of lattice model");
+    }
+    if (alpha != 2 && alpha != 4) throw("alpha not equal to 2 or 4 is not implemented");
+
+    // periodic 5-point Laplacian and its eigenvalues
+    std::vector<Eigen::Triplet<double>> trip;
+    trip.reserve(5 * W_size);
+    for (int j=0; j < ny; j++) {
+        for (int i=0; i < nx; i++) {
+            int k = i + nx * j;
+            trip.push_back(Eigen::Triplet<double>(k, k, 4.0));
+            trip.push_back(Eigen::Triplet<double>(k, (i+1) % nx + nx * j, -1.0));
+            trip.push_back(Eigen::Triplet<double>(k, (i+nx-1) % nx + nx * j, -1.0));
+            trip.push_back(Eigen::Triplet<double>(k, i + nx * ((j+1) % ny), -1.0));
+            trip.push_back(Eigen::Triplet<double>(k, i + nx * ((j+ny-1) % ny), -1.0));
+            glap(k) = 4 - 2*cos(2*M_PI*i/nx) - 2*cos(2*M_PI*j/ny);
+        }
+    }
+    G.setFromTriplets(trip.begin(), trip.end());
+
+    update_each_iter();
+if (debug) Rcpp::Rcout << "End Constructor of LatticeMatern" << std::endl;
+}
+
+VectorXd LatticeMatern::eigen_K(double kappa) const {
+    VectorXd lam = glap.array() + kappa * kappa * h_grid * h_grid;
+    if (alpha == 4) lam = lam.array().square() / (h_grid * h_grid);
+    return lam;
+}
+
+// d lambda / d theta_K, dkappa/dtheta = kappa
+VectorXd LatticeMatern::eigen_dK(double kappa) const {
+    if (alpha == 2) return VectorXd::Constant(W_size, 2 * kappa * kappa * h_grid * h_grid);
+    VectorXd lam_L = glap.array() + kappa * kappa * h_grid * h_grid;
+    return 4 * kappa * kappa * lam_L;
+}
+
+SparseMatrix<double> LatticeMatern::getK(const VectorXd& theta_K) const {
+    double kappa = th2k(theta_K(0));
+    SparseMatrix<double> I (W_size, W_size);
+    I.setIdentity();
+    SparseMatrix<double> L = kappa * kappa * h_grid * h_grid * I + G;
+    if (alpha == 2) return L;
+    return (L * L) / (h_grid * h_grid);
+}
+
+// wrt. theta_K
+SparseMatrix<double> LatticeMatern::get_dK(int index, const VectorXd& theta_K) const {
+    assert(index==0);
+    double kappa = th2k(theta_K(0));
+    SparseMatrix<double> I (W_size, W_size);
+    I.setIdentity();
+    if (alpha == 2) return 2 * kappa * kappa * h_grid * h_grid * I;
+    SparseMatrix<double> L = kappa * kappa * h_grid * h_grid * I + G;
+    return 4 * kappa * kappa * L;
+}
+
+// return length 1 vectorxd : grad wrt. theta_K
+VectorXd LatticeMatern::grad_theta_K() {
+    if (numer_grad) return numerical_grad();
+
+    double kappa = th2k(theta_K(0));
+    VectorXd V = getV();
+    VectorXd SV = getSV();
+
+    // tr(K^-1 dK) = sum(dlambda / lambda)
+    double trace_K = eigen_dK(kappa).cwiseQuotient(lambda).sum();
+    double tmp = (dK*W).cwiseProduct(SV.cwiseInverse()).dot(K * W + (h - V).cwiseProduct(mu))
+        + post_trace_dK(dK);
+    double grad = trace_K - tmp;
+    return VectorXd::Constant(1, - grad / W_size);
+}
+
+void LatticeMatern::update_each_iter() {
+    double kappa = th2k(theta_K(0));
+    K = getK(theta_K);
+    dK = get_dK(0, theta_K);
+    lambda = eigen_K(kappa);
+}
+
+// log|K| = sum(log lambda)
+double LatticeMatern::function_K(VectorXd& theta_K) {
+    SparseMatrix<double> K = getK(theta_K);
+    VectorXd V = getV();
+    VectorXd SV = getSV();
+    VectorXd tmp = K * W - mu.cwiseProduct(V-h);
+
+    double l = eigen_K(th2k(theta_K(0))).array().log().sum()
+        - 0.5 * tmp.cwiseProduct(SV.cwiseInverse()).dot(tmp);
+    if (exact_post) l -= 0.5 * diag_BSBt(K, post_cov).dot(SV.cwiseInverse());
+    return l;
+}
+
+// K^-1 rhs = F^-1 (F rhs / lambda)
+VectorXd LatticeMatern::solve_K(const VectorXd& rhs) {
+    MatrixXcd F = Eigen::Map<const MatrixXd>(rhs.data(), nx, ny).cast<std::complex<double>>();
+    fft2(F, false);
+    F.array() /= Eigen::Map<const MatrixXd>(lambda.data(), nx, ny).array().cast<std::complex<double>>();
+    fft2(F, true);
+    MatrixXd X = F.real();
+    return Eigen::Map<VectorXd>(X.data(), W_size);
+}
@@ -19,13 +19,15 @@ Rcpp::Rcout << "begin Constructor of Matern " << std::endl;
 
     // Init K and Q
     K = getK(theta_K);
+    dK = get_dK_by_index(0);
     SparseMatrix<double> Q = K.transpose() * K;
 
-    if (!use_iter_solver) {
-        chol_solver_K.init(W_size, 0,0,0);
-        chol_solver_K.analyze(K);
-    } else {
-        CG_solver_K.init(W_size, W_size, W_size, 0.5);
+    // cholesky is still used for the logdet in function_K
+    chol_solver_K.init(W_size, 0,0,0);
+    chol_solver_K.analyze(K);
+    if (use_iter_solver) {
+        // the AMG hierarchy is built here from the pattern of K
+        CG_solver_K.init(W_size, trace_iter, W_size, iter_solver_tol);
         CG_solver_K.analyze(K);
     }
 
@@ -36,26 +38,23 @@ Rcpp::Rcout << "begin Constructor of Matern " << std::endl;
 Rcpp::Rcout << "finish Constructor of Matern " << std::endl;
 }
 
-SparseMatrix<double> Matern::getK(const VectorXd& theta_K) const {
-    double kappa = th2k(theta_K(0));
+// T is double or ADScalar
+template <typename T>
+SparseMatrix<T, 0, int> Matern::assembleK(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta_K) const {
+    T kappa = th2k(theta_K(0));
     int W_size = G.rows();
 
-    SparseMatrix<double> K_a (W_size, W_size);
-        // VectorXd k2C = (kappa * kappa * Cdiag);
-        // SparseMatrix<double> KCK = k2C.asDiagonal();
-    SparseMatrix<double> KCK = kappa * kappa * C;
-
-    // VectorXd kappas = VectorXd::Constant(W_size, theta_K(0));
-    // SparseMatrix<double> KCK (W_size, W_size);
-    //     KCK = kappas.cwiseProduct(kappas).cwiseProduct(Cdiag).asDiagonal();
+    SparseMatrix<T, 0, int> K_a (W_size, W_size);
+    SparseMatrix<T, 0, int> KCK = kappa * kappa * C.cast<T>();
 
     if (alpha==2) {
         // K_a = T (G + KCK) C^(-1/2) -> Actually, K_a = C^{-1/2} (G+KCK), since Q = K^T K.
-        K_a = (G + KCK);
+        K_a = (G.cast<T>() + KCK);
     } else if (alpha==4) {
         // K_a = T (G + KCK) C^(-1) (G+KCK) C^(-1/2) -> Actually, K_a = C^{-1/2} (G + KCK) C^(-1) (G+KCK), since Q = K^T K.
-        K_a = (G + KCK) *
-            Cdiag.cwiseInverse().asDiagonal() * (G + KCK);
+        SparseMatrix<T, 0, int> GKCK = G.cast<T>() + KCK;
+        Eigen::Matrix<T, Eigen::Dynamic, 1> Cinv = Cdiag.cwiseInverse().cast<T>();
+        K_a = GKCK * Cinv.asDiagonal() * GKCK;
     } else {
         throw("alpha not equal to 2 or 4 is not implemented");
     }
@@ -63,47 +62,19 @@ SparseMatrix<double> Matern::getK(const VectorXd& theta_K) const {
     return K_a;
 }
 
-// stationary
-SparseMatrix<double> Matern::get_dK(int index, const VectorXd& theta_K) const {
-    assert(index==0);
-    double kappa = th2k(theta_K(0));
-    int W_size = G.rows();
-    SparseMatrix<double> dK (W_size, W_size);
-
-    if (alpha==2)
-        dK = 2.0*kappa*C;
-    else if (alpha==4)
-        dK = 4.0*kappa*C * G + 4.0* pow(kappa, 3) * C;
-    else
-        throw("alpha != 2 or 4");
-    return dK;
-}
-
-// compute numerical dK
-void Matern::update_num_dK() {
-    double eps = 0.01;
-    double kappa = th2k(theta_K(0));
-    SparseMatrix<double> K_add_eps = pow(kappa + eps, 2) * C + G;
-    dK = (K_add_eps - K) / eps;
-}
-
-// return length 1 vectorxd : grad_kappa * dkappa/dtheta
+// return length 1 vectorxd, dK = dK/dtheta already contains dkappa/dtheta
 VectorXd Matern::grad_theta_K() {
-    SparseMatrix<double> dK = get_dK_by_index(0);
     VectorXd V = getV();
     VectorXd SV = getSV();
 
-    double th = theta_K(0);
-    double da  = th2k(theta_K(0));
-    double d2a = th2k(theta_K(0));
-
     double ret = 0;
     if (numer_grad) {
         // 1. numerical gradient
         ret = numerical_grad()(0);
     } else {
         // 2. analytical gradient and numerical hessian
-        double tmp = (dK*W).cwiseProduct(SV.cwiseInverse()).dot(K * W + (h - V).cwiseProduct(mu));
+        double tmp = (dK*W).cwiseProduct(SV.cwiseInverse()).dot(K * W + (h - V).cwiseProduct(mu))
+            + post_trace_dK(dK);
         double grad = trace - tmp;
 
     // sth wrong with hessian?
@@ -111,7 +82,7 @@ VectorXd Matern::grad_theta_K() {
     // if (debug) Rcpp::Rcout << "trace =" << trace << std::endl;
 
         if (!use_precond) {
-            ret = - grad * da / W_size;
+            ret = - grad / W_size;
         } else {
             // compute numerical hessian
             SparseMatrix<double> K2 = getK_by_eps(0, eps);
@@ -134,9 +105,8 @@ VectorXd Matern::grad_theta_K() {
     // if (debug) Rcpp::Rcout << "grad =" << grad << std::endl;
     // if (debug) Rcpp::Rcout << "(hess * da + grad_eps) =" << (hess * da + grad_eps) << std::endl;
     // if (debug) Rcpp::Rcout << "hess =" << hess << std::endl;
-            // ret = (grad * da) / (hess * da * da + grad_eps * d2a); reduced to
-
-            ret = grad / (hess * da + grad_eps);
+            // hess is already d2/dtheta2 (chain rule included)
+            ret = grad / hess;
         }
     }
 
@@ -146,12 +116,7 @@ VectorXd Matern::grad_theta_K() {
 
 void Matern::update_each_iter() {
     K = getK(theta_K);
-    dK = get_dK(0, theta_K);
-    d2K = 0 * C;
-
-    if (use_num_dK) {
-        update_num_dK();
-    }
+    dK = get_dK_by_index(0);
 
     if (!numer_grad)
         compute_trace();
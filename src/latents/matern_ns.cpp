@@ -12,7 +12,7 @@ Matern_ns::Matern_ns(Rcpp::List& model_list, unsigned long seed)
     G           (Rcpp::as< SparseMatrix<double,0,int> > (model_list["G"])),
     C           (Rcpp::as< SparseMatrix<double,0,int> > (model_list["C"])),
     alpha       (Rcpp::as<int> (model_list["alpha"])),
-    Bkappa      (Rcpp::as<MatrixXd> (model_list["B_kappa"])),
+    Bkappa      (Basis(Rcpp::as<MatrixXd> (model_list["B_kappa"]))),
     Cdiag       (C.diagonal())
 {
 if (debug) Rcpp::Rcout << "constructor of matern ns" << std::endl;
@@ -29,29 +29,43 @@ if (debug) Rcpp::Rcout << "constructor of matern ns" << std::endl;
     // Init Q
     solver_Q.init(W_size, 0,0,0);
     solver_Q.analyze(Q);
+
+    // T = G + kappa^2 C, its inverse diagonal gives the alpha=4 traces
+    if (alpha == 4) {
+        SparseMatrix<double,0,int> T = G + C;
+        chol_solver_T.init(W_size, 0,0,0);
+        chol_solver_T.analyze(T);
+    }
 if (debug) Rcpp::Rcout << "finish constructor of matern ns" << std::endl;
 }
 
 // inherit get_K_parameter, grad_K_parameter, set_K_parameter
 
 SparseMatrix<double> Matern_ns::getK(const VectorXd& theta_kappa) const {
-    VectorXd kappas = (Bkappa * theta_kappa).array().exp();
-    Rcpp::Rcout <<  "theta_kappa here = " << theta_kappa << std::endl;
+    return assembleK<double>(theta_kappa);
+}
+
+// T is double or ADScalar, dK wrt. every theta_kappa comes from getK_ad
+template <typename T>
+SparseMatrix<T, 0, int> Matern_ns::assembleK(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta_kappa) const {
+    typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VectorT;
+    VectorT kappas = Bkappa.times(theta_kappa).array().exp();
 
     int n_dim = G.rows();
-    SparseMatrix<double> K_a (n_dim, n_dim);
-    SparseMatrix<double> KCK (n_dim, n_dim);
-        KCK = kappas.cwiseProduct(kappas).cwiseProduct(Cdiag).asDiagonal();
+    SparseMatrix<T, 0, int> K_a (n_dim, n_dim);
+    SparseMatrix<T, 0, int> KCK (n_dim, n_dim);
+        KCK = VectorT(kappas.cwiseProduct(kappas).cwiseProduct(Cdiag.cast<T>())).asDiagonal();
 
     if (alpha==2) {
         // K_a = T (G + KCK) C^(-1/2)
         // Actually, K_a = C^{-1/2} (G+KCK), since Q = K^T K.
-        K_a = (G + KCK);
+        K_a = (G.cast<T>() + KCK);
     } else if (alpha==4) {
         // K_a = T (G + KCK) C^(-1) (G+KCK) C^(-1/2)
         // Actually, K_a = C^{-1/2} (G + KCK) C^(-1) (G+KCK), since Q = K^T K.
-        K_a = (G + KCK) * Cdiag.cwiseInverse().asDiagonal() *
-        (G + KCK);
+        SparseMatrix<T, 0, int> GKCK = G.cast<T>() + KCK;
+        VectorT Cinv = Cdiag.cwiseInverse().cast<T>();
+        K_a = GKCK * Cinv.asDiagonal() * GKCK;
     } else {
         throw("alpha not equal to 2 or 4 is not implemented");
     }
@@ -59,43 +73,6 @@ SparseMatrix<double> Matern_ns::getK(const VectorXd& theta_kappa) const {
     return K_a;
 }
 
-// dK wrt. theta_K[index]
-SparseMatrix<double> Matern_ns::get_dK(int index, const VectorXd& params) const {
-    VectorXd kappas = (Bkappa * theta_K).array().exp();
-
-    int n_dim = G.rows();
-    SparseMatrix<double> dK_a (n_dim, n_dim);
-
-    // dKCK
-    SparseMatrix<double> CK(n_dim, n_dim);
-    // CK = kappas.cwiseProduct(Cdiag).asDiagonal();
-
-    SparseMatrix<double> dKCK(n_dim, n_dim);
-    //  dKCK = 2*kappas.cwiseProduct(Bkappa.col(index)).asDiagonal() * CK;
-    // kappas * (Bkappa * CK + CK * Bkappa).sparseView();
-        VectorXd kappas2 = kappas.cwiseProduct(kappas);
-        dKCK = 2*kappas2.cwiseProduct(Cdiag).cwiseProduct(Bkappa.col(index)).asDiagonal();
-
-
-    if (alpha == 2)
-    {
-        dK_a = dKCK;
-    }
-    else if (alpha == 4)
-    {
-        SparseMatrix<double> KCK(n_dim, n_dim);
-        KCK = kappas.cwiseProduct(kappas).cwiseProduct(Cdiag).asDiagonal();
-        SparseMatrix<double> tmp = Cdiag.cwiseInverse().asDiagonal() * (G + KCK);
-        dK_a = dKCK * tmp + tmp * dKCK;
-    }
-    else
-    {
-        throw("alpha not equal to 2 or 4 is not implemented");
-    }
-
-    return dK_a;
-}
-
 VectorXd Matern_ns::grad_theta_K() {
     VectorXd V = getV();
     VectorXd SV = getSV();
@@ -105,22 +82,40 @@ VectorXd Matern_ns::grad_theta_K() {
         // 1. numerical gradient
         grad = numerical_grad();
     } else {
-        // 2. analytical gradient and numerical hessian
-        chol_solver_K.compute(K);
-        for (int i=0; i < n_theta_K; i++) {
-            // dK for each index
-            SparseMatrix<double> dK = get_dK_by_index(i);
-
-            VectorXd tmp2 = K * W + (h - V).cwiseProduct(mu);
-            double tmp = (dK*W).cwiseProduct(SV.cwiseInverse()).dot(tmp2);
-
-            // compute trace
-            if (i > 0) {
-                trace = chol_solver_K.trace(dK);
-            }
+        // 2. analytical gradient, all theta_K at once
+        //  with T = G + kappa^2 C and dD_i = diag(d .* Bkappa_i), d = 2 kappa^2 Cdiag,
+        //  dK_i = dD_i (alpha=2), or dD_i C^-1 T + T C^-1 dD_i (alpha=4)
+        //  so tr(dK_i K^-1) and r^T dK_i W are Bkappa_i^T times a nodewise weight
+        VectorXd kappas = Bkappa.times(theta_K).array().exp();
+        VectorXd d = 2 * kappas.cwiseProduct(kappas).cwiseProduct(Cdiag);
+        VectorXd r = (K * W + (h - V).cwiseProduct(mu)).cwiseQuotient(SV);
+
+        VectorXd w_trace, w_quad;
+        if (alpha == 2) {
+            chol_solver_K.compute(K);
+            w_trace = d.cwiseProduct(chol_solver_K.Qinv_diag());
+            w_quad  = d.cwiseProduct(W).cwiseProduct(r);
+        } else {
+            // K^-1 = T^-1 C T^-1, so tr(dK_i K^-1) = 2 tr(dD_i T^-1)
+            int n_dim = G.rows();
+            SparseMatrix<double,0,int> KCK (n_dim, n_dim);
+                KCK = kappas.cwiseProduct(kappas).cwiseProduct(Cdiag).asDiagonal();
+            SparseMatrix<double,0,int> T = G + KCK;
+            chol_solver_T.compute(T);
+            VectorXd Cinv = Cdiag.cwiseInverse();
+            w_trace = 2 * d.cwiseProduct(chol_solver_T.Qinv_diag());
+            w_quad  = d.cwiseProduct(
+                Cinv.cwiseProduct(T * W).cwiseProduct(r) + W.cwiseProduct(Cinv.cwiseProduct(T * r))
+            );
+        }
 
-            grad(i) = (trace - tmp) / W_size;
+        grad = Bkappa.t_times(w_trace - w_quad);
+        if (exact_post) {
+            vector<SparseMatrix<double,0,int>> dKs = get_dK_all(theta_K);
+            for (int i=0; i < n_theta_K; i++)
+                grad(i) -= post_trace_dK(dKs[i]);
         }
+        grad = grad / W_size;
     }
 
     return grad;
@@ -128,8 +123,6 @@ VectorXd Matern_ns::grad_theta_K() {
 
 void Matern_ns::update_each_iter() {
     K = getK(theta_K);
-    if (!numer_grad)
-      compute_trace();
 }
 
 // class nonstationaryGC : public Operator {
@@ -0,0 +1,164 @@
+/*
+    Separable space-time model:
+        parameter_K = (alpha_t, kappa), theta_K = (a2th(alpha_t), log(kappa))
+        K = K_t kron K_s
+        K_t = alpha_t * C_t + G_t           (AR1 in time)
+        K_s = kappa^2 * C_s + G_s, alpha=2  (Matern in space)
+              (G_s + kappa^2 C_s) C_s^-1 (G_s + kappa^2 C_s), alpha=4
+    K is only assembled for the block model, traces, logdet and
+    solves use the factorizations of K_t and K_s.
+*/
+
+#include "../latent.h"
+
+Spacetime::Spacetime(Rcpp::List& model_list, unsigned long seed)
+: Latent(model_list, seed),
+    G_t         (Rcpp::as< SparseMatrix<double,0,int> > (model_list["G_t"])),
+    C_t         (Rcpp::as< SparseMatrix<double,0,int> > (model_list["C_t"])),
+    G_s         (Rcpp::as< SparseMatrix<double,0,int> > (model_list["G_s"])),
+    C_s         (Rcpp::as< SparseMatrix<double,0,int> > (model_list["C_s"])),
+    alpha       (Rcpp::as<int> (model_list["alpha"])),
+    Cdiag_s     (C_s.diagonal()),
+    n_t         (G_t.rows()),
+    n_s         (G_s.rows()),
+    traces      (VectorXd::Zero(2))
+{
+if (debug) Rcpp::Rcout << "Begin Constructor of Spacetime" << std::endl;
+
+    if (n_t * n_s != W_size || W_size != V_size) {
+        Rcpp::Rcout << "Spacetime: W_size should be n_t * n_s = " << n_t * n_s << std::endl;
+        throw("wrong dimension of spacetime model");
+    }
+
+    K_t = getK_t(theta_K(0));
+    K_s = getK_s(theta_K(1));
+    dK_t = get_dK_t(theta_K(0));
+    dK_s = get_dK_s(theta_K(1));
+    K = kronecker(K_t, K_s);
+
+    lu_t.init(n_t, 0,0,0);
+    lu_t.analyze(K_t);
+    chol_s.init(n_s, 0,0,0);
+    chol_s.analyze(K_s);
+
+    update_each_iter();
+if (debug) Rcpp::Rcout << "End Constructor of Spacetime" << std::endl;
+}
+
+SparseMatrix<double, 0, int> Spacetime::getK_t(double th) const {
+    return th2a(th) * C_t + G_t;
+}
+
+SparseMatrix<double, 0, int> Spacetime::getK_s(double th) const {
+    double kappa = th2k(th);
+    SparseMatrix<double, 0, int> L = G_s + kappa * kappa * C_s;
+    if (alpha == 2) return L;
+    else if (alpha == 4) return L * Cdiag_s.cwiseInverse().asDiagonal() * L;
+    else throw("alpha not equal to 2 or 4 is not implemented");
+}
+
+// wrt. theta_K(0), dalpha_t/dth = 2 e^th / (1+e^th)^2
+SparseMatrix<double, 0, int> Spacetime::get_dK_t(double th) const {
+    return 2 * exp(th) / pow(1 + exp(th), 2) * C_t;
+}
+
+// wrt. theta_K(1), dkappa/dth = kappa
+SparseMatrix<double, 0, int> Spacetime::get_dK_s(double th) const {
+    double kappa = th2k(th);
+    if (alpha == 2) return 2.0 * kappa * kappa * C_s;
+    SparseMatrix<double, 0, int> L = G_s + kappa * kappa * C_s;
+    SparseMatrix<double, 0, int> CiL = Cdiag_s.cwiseInverse().asDiagonal() * L;
+    SparseMatrix<double, 0, int> LCi = L * Cdiag_s.cwiseInverse().asDiagonal();
+    return 2.0 * kappa * kappa * (C_s * CiL + LCi * C_s);
+}
+
+SparseMatrix<double> Spacetime::getK(const VectorXd& theta_K) const {
+    SparseMatrix<double, 0, int> Kt = getK_t(theta_K(0));
+    SparseMatrix<double, 0, int> Ks = getK_s(theta_K(1));
+    return kronecker(Kt, Ks);
+}
+
+// wrt. theta_K(0) (alpha_t) and theta_K(1) (kappa)
+SparseMatrix<double> Spacetime::get_dK(int index, const VectorXd& theta_K) const {
+    SparseMatrix<double, 0, int> Kt = getK_t(theta_K(0));
+    SparseMatrix<double, 0, int> Ks = getK_s(theta_K(1));
+    if (index == 0) {
+        SparseMatrix<double, 0, int> dKt = get_dK_t(theta_K(0));
+        return kronecker(dKt, Ks);
+    }
+    SparseMatrix<double, 0, int> dKs = get_dK_s(theta_K(1));
+    return kronecker(Kt, dKs);
+}
+
+VectorXd Spacetime::grad_theta_K() {
+    if (numer_grad) return numerical_grad();
+
+    VectorXd V = getV();
+    VectorXd SV = getSV();
+    VectorXd res = kron_matvec(K_t, K_s, W) + (h - V).cwiseProduct(mu);
+
+    // tr((K_t kron K_s)^-1 (dK_t kron K_s)) = n_s tr(K_t^-1 dK_t), similarly for kappa
+    VectorXd dKW_t = kron_matvec(dK_t, K_s, W);
+    VectorXd dKW_s = kron_matvec(K_t, dK_s, W);
+    double tmp_t = dKW_t.cwiseQuotient(SV).dot(res);
+    double tmp_s = dKW_s.cwiseQuotient(SV).dot(res);
+    if (exact_post) {
+        tmp_t += post_trace_dK(get_dK(0, theta_K));
+        tmp_s += post_trace_dK(get_dK(1, theta_K));
+    }
+
+    VectorXd grad (2);
+    grad(0) = - (traces(0) - tmp_t) / W_size;
+    grad(1) = - (traces(1) - tmp_s) / W_size;
+    return grad;
+}
+
+void Spacetime::update_each_iter() {
+    K_t = getK_t(theta_K(0));
+    K_s = getK_s(theta_K(1));
+    dK_t = get_dK_t(theta_K(0));
+    dK_s = get_dK_s(theta_K(1));
+    K = kronecker(K_t, K_s);
+
+    if (!numer_grad) {
+        lu_t.compute(K_t);
+        chol_s.compute(K_s);
+        traces(0) = n_s * lu_t.trace(dK_t);
+        traces(1) = n_t * chol_s.trace(dK_s);
+    }
+}
+
+double Spacetime::function_K(VectorXd& theta_K) {
+    SparseMatrix<double, 0, int> Kt = getK_t(theta_K(0));
+    SparseMatrix<double, 0, int> Ks = getK_s(theta_K(1));
+    VectorXd V = getV();
+    VectorXd SV = getSV();
+
+    lu_t.compute(Kt);
+    chol_s.compute(Ks);
+    double logdet_K = n_s * lu_t.logdet() + n_t * chol_s.logdet();
+
+    VectorXd tmp = kron_matvec(Kt, Ks, W) - mu.cwiseProduct(V-h);
+    double l = logdet_K - 0.5 * SV.array().log().sum()
+        - 0.5 * tmp.cwiseProduct(SV.cwiseInverse()).dot(tmp);
+    if (exact_post) {
+        SparseMatrix<double, 0, int> Kf = kronecker(Kt, Ks);
+        l -= 0.5 * diag_BSBt(Kf, post_cov).dot(SV.cwiseInverse());
+    }
+    return l;
+}
+
+// (K_t kron K_s) vec(X) = vec(B)  <=>  X = K_s^-1 B K_t^-T
+VectorXd Spacetime::solve_K(const VectorXd& rhs) {
+    lu_t.factorizeLU(K_t);
+    chol_s.compute(K_s);
+
+    Eigen::Map<const MatrixXd> B (rhs.data(), n_s, n_t);
+    MatrixXd Y (n_s, n_t);
+    for (int j=0; j < n_t; j++)
+        Y.col(j) = chol_s.solve(VectorXd(B.col(j)));
+
+    MatrixXd Xt = lu_t.solve_multi(Y.transpose());
+    MatrixXd X = Xt.transpose();
+    return Eigen::Map<VectorXd>(X.data(), W_size);
+}
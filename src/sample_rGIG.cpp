@@ -21,3 +21,19 @@ Eigen::VectorXd rGIG_cpp(Eigen::VectorXd p,
     V[i] = sampler.sample(p[i], a[i], b[i]);
   return V;
 }
+
+void rGIG_fill(double p, double a, double b,
+               const Eigen::VectorXd& a_inc,
+               const Eigen::VectorXd& b_inc,
+               Eigen::VectorXd& V,
+               unsigned long seed) {
+
+  gig sampler;
+  if(seed == 0)
+    seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+  sampler.seed(seed);
+
+  bool has_a = a_inc.size() > 0, has_b = b_inc.size() > 0;
+  for(int i = 0; i < V.size(); i++)
+    V[i] = sampler.sample(p, has_a ? a + a_inc[i] : a, has_b ? b + b_inc[i] : b);
+}
@@ -6,4 +6,11 @@
 Eigen::VectorXd rGIG_cpp(Eigen::VectorXd,
                        	 Eigen::VectorXd,
                        	 Eigen::VectorXd,
-                       	 unsigned long=0);
\ No newline at end of file
+                       	 unsigned long=0);
+
+// V(i) ~ GIG(p, a + a_inc(i), b + b_inc(i)) sampled in place, empty a_inc / b_inc are 0
+void rGIG_fill(double p, double a, double b,
+               const Eigen::VectorXd& a_inc,
+               const Eigen::VectorXd& b_inc,
+               Eigen::VectorXd& V,
+               unsigned long=0);
\ No newline at end of file
@@ -0,0 +1,247 @@
+// entry points of the numerical kernels for the unit tests (tests/testthat), not exported
+
+#include <Rcpp.h>
+#include <RcppEigen.h>
+#include <random>
+#include <algorithm>
+#include "latent.h"
+#include "block.h"
+#include "include/solver.h"
+#include "include/slq.h"
+#include "include/summary.h"
+#include "include/ellmatrix.h"
+#include "include/GIG.h"
+#include "include/basis.h"
+
+using Eigen::SparseMatrix;
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+
+Rcpp::List summary_output(const PosteriorSummary& s);
+
+// AMG preconditioned CG on every column of B, one column at a time (single) and all at once (block)
+// [[Rcpp::export]]
+Rcpp::List pcg_solve_cpp(Eigen::SparseMatrix<double> Q, const Eigen::MatrixXd& B, int max_iter, double tol) {
+    iterative_solver solver;
+    solver.init(Q.rows(), 1, max_iter, tol);
+    solver.analyze(Q);
+    solver.compute(Q);
+
+    MatrixXd X (B.rows(), B.cols());
+    for (int j=0; j < B.cols(); j++) {
+        VectorXd b = B.col(j), x0 = VectorXd::Zero(B.rows());
+        X.col(j) = solver.solve(b, x0);
+    }
+    return Rcpp::List::create(
+        Rcpp::Named("single")   = X,
+        Rcpp::Named("block")    = solver.solve_block(B, MatrixXd::Zero(B.rows(), B.cols()))
+    );
+}
+
+// Hutchinson estimate of tr(M Q^-1) with n_probes Rademacher probes, the solves by AMG-PCG
+// [[Rcpp::export]]
+double hutchinson_trace_cpp(Eigen::SparseMatrix<double> Q, Eigen::SparseMatrix<double> M, int n_probes, int max_iter, double tol) {
+    iterative_solver solver;
+    solver.init(Q.rows(), n_probes, max_iter, tol);
+    solver.analyze(Q);
+    solver.compute(Q);
+    return solver.trace(M);
+}
+
+// SLQ estimate of log|Q| with n_probes Rademacher probes drawn from seed
+// [[Rcpp::export]]
+double slq_logdet_cpp(Eigen::SparseMatrix<double> Q, int n_probes, int depth, unsigned long seed) {
+    std::mt19937 rng (seed);
+    std::bernoulli_distribution coin (0.5);
+    MatrixXd probes (Q.rows(), n_probes);
+    for (int i=0; i < probes.size(); i++)
+        probes.data()[i] = coin(rng) ? 1.0 : -1.0;
+
+    return slq_logdet([&](const VectorXd& v) -> VectorXd {
+        return Q * v;
+    }, probes, depth);
+}
+
+// gradient of the latent model wrt. theta_K (grad_theta_K), and the central difference
+// of function_K on the same scale (divided by W_size)
+// [[Rcpp::export]]
+Rcpp::List grad_theta_K_cpp(Rcpp::List model_list, double eps) {
+    std::unique_ptr<Latent> latent = create_latent(model_list, 1);
+    if (!latent)
+        Rcpp::stop("Unknown model: " + Rcpp::as<std::string> (model_list["model"]));
+
+    VectorXd grad = latent->grad_theta_K();
+    VectorXd theta_K = Rcpp::as<VectorXd> (model_list["theta_K"]);
+    VectorXd numerical (theta_K.size());
+    for (int i=0; i < theta_K.size(); i++) {
+        VectorXd th_add = theta_K, th_minus = theta_K;
+        th_add(i) += eps;
+        th_minus(i) -= eps;
+        numerical(i) = (latent->function_K(th_add) - latent->function_K(th_minus)) / (2 * eps * latent->get_W_size());
+    }
+    return Rcpp::List::create(
+        Rcpp::Named("grad")         = grad,
+        Rcpp::Named("numerical")    = numerical
+    );
+}
+
+// dK wrt. every theta_K from get_dK, and the central differences of getK
+// [[Rcpp::export]]
+Rcpp::List get_dK_cpp(Rcpp::List model_list, double eps) {
+    std::unique_ptr<Latent> latent = create_latent(model_list, 1);
+    if (!latent)
+        Rcpp::stop("Unknown model: " + Rcpp::as<std::string> (model_list["model"]));
+
+    VectorXd theta_K = Rcpp::as<VectorXd> (model_list["theta_K"]);
+    Rcpp::List dK, numerical;
+    for (int i=0; i < theta_K.size(); i++) {
+        VectorXd th_add = theta_K, th_minus = theta_K;
+        th_add(i) += eps;
+        th_minus(i) -= eps;
+        dK.push_back(Rcpp::wrap(SparseMatrix<double>(latent->get_dK(i, theta_K))));
+        numerical.push_back(Rcpp::wrap(SparseMatrix<double>((latent->getK(th_add) - latent->getK(th_minus)) / (2 * eps))));
+    }
+    return Rcpp::List::create(
+        Rcpp::Named("dK")           = dK,
+        Rcpp::Named("numerical")    = numerical
+    );
+}
+
+// streaming summary of the rows of draws, split into n_chains consecutive chains which are merged
+// [[Rcpp::export]]
+Rcpp::List posterior_summary_cpp(const Eigen::MatrixXd& draws, const Eigen::VectorXd& probs, const Eigen::VectorXd& thresholds, int n_chains) {
+    n_chains = std::max(std::min(n_chains, (int) draws.rows()), 1);
+    std::vector<PosteriorSummary> chains (n_chains, PosteriorSummary(draws.cols(), probs, thresholds));
+    for (int r=0; r < draws.rows(); r++)
+        chains[(long) r * n_chains / draws.rows()].add(draws.row(r).transpose());
+
+    try {
+        for (int i=1; i < n_chains; i++)
+            chains[0].merge(chains[i]);
+    } catch (const char* msg) {
+        Rcpp::stop(msg);
+    }
+    return summary_output(chains[0]);
+}
+
+// gradient of beta at the initial W and V of the block, with that W and the measurement noise V
+// [[Rcpp::export]]
+Rcpp::List grad_beta_cpp(const Rcpp::List& ngme_block) {
+    BlockModel block (ngme_block, Rcpp::as<unsigned long> (ngme_block["seed"]));
+    return Rcpp::List::create(
+        Rcpp::Named("grad")     = block.grad_beta(),
+        Rcpp::Named("W")        = block.getW(),
+        Rcpp::Named("V")        = block.get_VW()[0]
+    );
+}
+
+// gradient (grad_theta_K), log-likelihood of K (function_K) at theta_K and K^-1 B column by column (solve_K);
+// at W = 0, V = h and sigma = 1 these are -tr(K^-1 dK) / W_size, log|K| and the prior solve
+// [[Rcpp::export]]
+Rcpp::List latent_kernels_cpp(Rcpp::List model_list, const Eigen::MatrixXd& B) {
+    std::unique_ptr<Latent> latent = create_latent(model_list, 1);
+    if (!latent)
+        Rcpp::stop("Unknown model: " + Rcpp::as<std::string> (model_list["model"]));
+
+    VectorXd theta_K = Rcpp::as<VectorXd> (model_list["theta_K"]);
+    VectorXd grad = latent->grad_theta_K();
+    double loglik = latent->function_K(theta_K);
+    MatrixXd X (B.rows(), B.cols());
+    for (int j=0; j < B.cols(); j++)
+        X.col(j) = latent->solve_K(B.col(j));
+    return Rcpp::List::create(
+        Rcpp::Named("grad")     = grad,
+        Rcpp::Named("loglik")   = loglik,
+        Rcpp::Named("solve")    = X
+    );
+}
+
+// eigenvalues of K of the periodic lattice model and their derivatives wrt. theta_K, in the order of W
+// [[Rcpp::export]]
+Rcpp::List lattice_eigen_cpp(Rcpp::List model_list) {
+    LatticeMatern latent (model_list, 1);
+    VectorXd theta_K = Rcpp::as<VectorXd> (model_list["theta_K"]);
+    double kappa = latent.th2k(theta_K(0));
+    return Rcpp::List::create(
+        Rcpp::Named("lambda")   = latent.eigen_K(kappa),
+        Rcpp::Named("dlambda")  = latent.eigen_dK(kappa)
+    );
+}
+
+// A x, A^T y and A^T diag(w) A of A in ELL format (NULL products if A has more than 4 entries in a row)
+// [[Rcpp::export]]
+Rcpp::List ell_matrix_cpp(const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& x, const Eigen::VectorXd& y, const Eigen::VectorXd& w) {
+    ELLMatrix ell;
+    if (!ell.compress(A))
+        return Rcpp::List::create(Rcpp::Named("k") = ell.get_k());
+
+    SparseMatrix<double> gram;
+    ell.gram_pattern(gram);
+    ell.weighted_gram(w, gram);
+    return Rcpp::List::create(
+        Rcpp::Named("k")        = ell.get_k(),
+        Rcpp::Named("times")    = ell.times(x),
+        Rcpp::Named("t_times")  = ell.t_times(y),
+        Rcpp::Named("gram")     = gram
+    );
+}
+
+// E[W|V,Y] of the block from the components of QQ and from the factorization of the full QQ
+// [[Rcpp::export]]
+Rcpp::List component_mean_cpp(const Rcpp::List& ngme_block) {
+    BlockModel block (ngme_block, Rcpp::as<unsigned long> (ngme_block["seed"]));
+    return Rcpp::List::create(
+        Rcpp::Named("n_comp")       = block.get_n_comp(),
+        Rcpp::Named("components")   = block.cond_mean_components(),
+        Rcpp::Named("full")         = block.cond_mean_W()
+    );
+}
+
+// one gradient of the block at its parameters (exact Gaussian mode if the control asks for it)
+// [[Rcpp::export]]
+Eigen::VectorXd block_grad_cpp(const Rcpp::List& ngme_block) {
+    BlockModel block (ngme_block, Rcpp::as<unsigned long> (ngme_block["seed"]));
+    return block.grad();
+}
+
+// mean of [W; beta] | V, Y of the joint sampler, and the mean of beta it keeps for grad_beta
+// [[Rcpp::export]]
+Rcpp::List joint_mean_cpp(const Rcpp::List& ngme_block) {
+    BlockModel block (ngme_block, Rcpp::as<unsigned long> (ngme_block["seed"]));
+    VectorXd beta = Rcpp::as<VectorXd> (ngme_block["beta"]);
+    VectorXd mean = block.cond_mean_Wbeta();
+    block.sampleW_VY();
+    return Rcpp::List::create(
+        Rcpp::Named("mean")         = mean,
+        Rcpp::Named("beta_post")    = VectorXd(beta - block.grad_beta())
+    );
+}
+
+// E[V] and E[1/V] of GIG(p, a, b) elementwise, from EV_EiV_GIG and from EV_GIG / EiV_GIG
+// [[Rcpp::export]]
+Rcpp::List gig_moments_cpp(const Eigen::VectorXd& p, const Eigen::VectorXd& a, const Eigen::VectorXd& b) {
+    VectorXd EV, EiV, EV_single (p.size()), EiV_single (p.size());
+    EV_EiV_GIG(p, a, b, EV, EiV);
+    for (int i=0; i < p.size(); i++) {
+        EV_single(i) = EV_GIG(p(i), a(i), b(i));
+        EiV_single(i) = EiV_GIG(p(i), a(i), b(i));
+    }
+    return Rcpp::List::create(
+        Rcpp::Named("EV")           = EV,
+        Rcpp::Named("EiV")          = EiV,
+        Rcpp::Named("EV_single")    = EV_single,
+        Rcpp::Named("EiV_single")   = EiV_single
+    );
+}
+
+// representation picked by Basis::set, B theta and B^T v
+// [[Rcpp::export]]
+Rcpp::List basis_cpp(const Eigen::MatrixXd& B, const Eigen::VectorXd& theta, const Eigen::VectorXd& v) {
+    Basis basis (B);
+    std::string type = basis.is_constant() ? "constant" : (basis.is_sparse() ? "sparse" : "dense");
+    return Rcpp::List::create(
+        Rcpp::Named("type")     = type,
+        Rcpp::Named("times")    = basis.times(theta),
+        Rcpp::Named("t_times")  = basis.t_times(v)
+    );
+}
@@ -51,6 +51,25 @@ double EV_GIG(double p, double a, double b) {
   return EV;
 }
 
+void EV_EiV_GIG(const Eigen::VectorXd &p,
+                const Eigen::VectorXd &a,
+                const Eigen::VectorXd &b,
+                Eigen::VectorXd &EV,
+                Eigen::VectorXd &EiV)
+{
+  int n = p.size();
+  EV.resize(n);
+  EiV.resize(n);
+  for (int i = 0; i < n; i++) {
+    double sqrt_ab = sqrt(a[i] * b[i]);
+    // exponentially scaled, the scaling cancels in the ratio
+    double ratio = R::bessel_k(sqrt_ab, p[i] + 1, 2) / R::bessel_k(sqrt_ab, p[i], 2);
+    double sqrt_b_div_a = sqrt(b[i] / a[i]);
+    EV[i]  = ratio * sqrt_b_div_a;
+    EiV[i] = ratio / sqrt_b_div_a - (2 * p[i]) / b[i];
+  }
+}
+
 double dlambda_V(const double loglambda,
                  const Eigen::VectorXd &V, 
                  const Eigen::VectorXd &h,
@@ -540,6 +540,15 @@ SparseMatrix<double, 0, int> Qinv2(SparseMatrix<double, 0, int> &L)
 	return Sigma;
 }
 
+VectorXd kron_matvec(const SparseMatrix<double, 0, int> &A, const SparseMatrix<double, 0, int> &B, const VectorXd &x)
+{
+	// (A kron B) vec(X) = vec(B X A^T)
+	Map<const MatrixXd> X(x.data(), B.cols(), A.cols());
+	MatrixXd BX = B * X;
+	MatrixXd Y = BX * A.transpose();
+	return Map<VectorXd>(Y.data(), Y.size());
+}
+
 SparseMatrix<double, 0, int> kronecker(SparseMatrix<double, 0, int> &A, SparseMatrix<double, 0, int> &B)
 {
 	int Br = B.rows();
@@ -632,6 +641,78 @@ SparseMatrix<double, 0, int> full2sparse(MatrixXd &M)
 	return A;
 }
 
+VectorXd diag_BSBt(const SparseMatrix<double, 0, int> &B, const SparseMatrix<double, 0, int> &S)
+{
+	SparseMatrix<double, 0, int> BS = B * S;
+	return BS.cwiseProduct(B) * VectorXd::Ones(B.cols());
+}
+
+void weighted_gram(const MatrixXd &X, const VectorXd &w, MatrixXd &G)
+{
+	const int n = X.rows();
+	const int p = X.cols();
+	const int block = 1024;
+	const int n_blocks = (n + block - 1) / block;
+
+	G.setZero(p, p);
+#pragma omp parallel
+	{
+		MatrixXd G_local = MatrixXd::Zero(p, p);
+		MatrixXd Xw(block, p);
+#pragma omp for schedule(static)
+		for (int b = 0; b < n_blocks; b++)
+		{
+			int start = b * block;
+			int len = min(block, n - start);
+			Xw.topRows(len) = w.segment(start, len).cwiseSqrt().asDiagonal() * X.middleRows(start, len);
+			G_local.selfadjointView<Lower>().rankUpdate(Xw.topRows(len).transpose());
+		}
+#pragma omp critical
+		G += G_local;
+	}
+	G.triangularView<StrictlyUpper>() = G.transpose();
+}
+
+static int uf_find(std::vector<int> &parent, int i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+int connected_components(const SparseMatrix<double, 0, int> &Q, VectorXi &label)
+{
+	const int n = Q.cols();
+	std::vector<int> parent(n);
+	for (int i = 0; i < n; i++)
+		parent[i] = i;
+
+	// union-find over the nonzeros
+	for (int k = 0; k < Q.outerSize(); k++)
+		for (SparseMatrix<double, 0, int>::InnerIterator it(Q, k); it; ++it)
+		{
+			int a = uf_find(parent, it.row()), b = uf_find(parent, it.col());
+			if (a != b)
+				parent[max(a, b)] = min(a, b);
+		}
+
+	// number the roots in order of first appearance
+	label.resize(n);
+	std::vector<int> root_label(n, -1);
+	int n_comp = 0;
+	for (int i = 0; i < n; i++)
+	{
+		int r = uf_find(parent, i);
+		if (root_label[r] < 0)
+			root_label[r] = n_comp++;
+		label(i) = root_label[r];
+	}
+	return n_comp;
+}
+
 Eigen::MatrixXd NormalOuterExpectation(const Eigen::MatrixXd &Sigma,
 									   const Eigen::VectorXd &mu,
 									   const Eigen::VectorXd &m)
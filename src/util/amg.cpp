@@ -0,0 +1,137 @@
+#include "../include/amg.h"
+
+using namespace Eigen;
+
+// greedy aggregation on the graph of A, returns the number of aggregates
+int AMGPreconditioner::aggregate(const SpMat &A, SpMat &P0) const
+{
+	const int n = A.cols();
+	std::vector<int> agg(n, -1);
+	int n_agg = 0;
+
+	// 1. a node whose neighbours are all free forms an aggregate with them
+	for (int i = 0; i < n; i++)
+	{
+		if (agg[i] >= 0)
+			continue;
+		bool free = true;
+		for (SpMat::InnerIterator it(A, i); it; ++it)
+			if (agg[it.row()] >= 0)
+			{
+				free = false;
+				break;
+			}
+		if (!free)
+			continue;
+		for (SpMat::InnerIterator it(A, i); it; ++it)
+			agg[it.row()] = n_agg;
+		agg[i] = n_agg++;
+	}
+
+	// 2. remaining nodes join a neighbouring aggregate from step 1
+	std::vector<int> agg1 = agg;
+	for (int i = 0; i < n; i++)
+	{
+		if (agg[i] >= 0)
+			continue;
+		for (SpMat::InnerIterator it(A, i); it; ++it)
+			if (agg1[it.row()] >= 0)
+			{
+				agg[i] = agg1[it.row()];
+				break;
+			}
+	}
+
+	// 3. isolated leftovers form their own aggregates
+	for (int i = 0; i < n; i++)
+		if (agg[i] < 0)
+			agg[i] = n_agg++;
+
+	std::vector<Triplet<double>> trip;
+	trip.reserve(n);
+	for (int i = 0; i < n; i++)
+		trip.push_back(Triplet<double>(i, agg[i], 1.0));
+	P0.resize(n, n_agg);
+	P0.setFromTriplets(trip.begin(), trip.end());
+	return n_agg;
+}
+
+// P = (I - omega D^-1 A) P0,  A_next = P^T A P
+void AMGPreconditioner::coarsen(Level &L, SpMat &A_next) const
+{
+	L.inv_diag = L.A.diagonal().cwiseInverse();
+	SpMat AP0 = L.A * L.P0;
+	L.P = L.P0 - omega * L.inv_diag.asDiagonal() * AP0;
+	L.Pt = L.P.transpose();
+	A_next = L.Pt * L.A * L.P;
+}
+
+void AMGPreconditioner::analyze_impl(const SpMat &A)
+{
+	levels.clear();
+	SpMat Al = A;
+	while ((int)levels.size() < max_levels - 1 && Al.rows() > coarse_size)
+	{
+		Level L;
+		L.A = Al;
+		int n_agg = aggregate(L.A, L.P0);
+		if (n_agg == Al.rows())
+			break; // no coarsening possible
+		coarsen(L, Al);
+		levels.push_back(L);
+	}
+	coarse_A = Al;
+	coarse_solver.analyzePattern(coarse_A);
+	initialized = true;
+}
+
+void AMGPreconditioner::factorize_impl(const SpMat &A)
+{
+	SpMat Al = A;
+	for (size_t l = 0; l < levels.size(); l++)
+	{
+		levels[l].A = Al;
+		coarsen(levels[l], Al);
+	}
+	if (Al.nonZeros() != coarse_A.nonZeros())
+		coarse_solver.analyzePattern(Al);
+	coarse_A = Al;
+	coarse_solver.factorize(coarse_A);
+	m_info = coarse_solver.info();
+}
+
+void AMGPreconditioner::vcycle(int l, const MatrixXd &b, MatrixXd &x) const
+{
+	if (l == (int)levels.size())
+	{
+		x = coarse_solver.solve(b);
+		return;
+	}
+	const Level &L = levels[l];
+
+	x.setZero(b.rows(), b.cols());
+	for (int s = 0; s < n_smooth; s++)
+		x += omega * L.inv_diag.asDiagonal() * (b - L.A * x);
+
+	MatrixXd rc = L.Pt * (b - L.A * x);
+	MatrixXd ec;
+	vcycle(l + 1, rc, ec);
+	x += L.P * ec;
+
+	for (int s = 0; s < n_smooth; s++)
+		x += omega * L.inv_diag.asDiagonal() * (b - L.A * x);
+}
+
+VectorXd AMGPreconditioner::solve(const VectorXd &b) const
+{
+	MatrixXd x;
+	vcycle(0, b, x);
+	return x.col(0);
+}
+
+MatrixXd AMGPreconditioner::solve(const MatrixXd &b) const
+{
+	MatrixXd x;
+	vcycle(0, b, x);
+	return x;
+}
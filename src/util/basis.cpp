@@ -0,0 +1,45 @@
+#include "../include/basis.h"
+
+void Basis::set(const MatrixXd &B, double sparse_ratio)
+{
+	n = B.rows();
+	p = B.cols();
+	c = 0;
+	S.resize(0, 0);
+	D.resize(0, 0);
+
+	if (p == 1 && n > 0 && (B.array() == B(0, 0)).all())
+	{
+		type = basis_constant;
+		c = B(0, 0);
+	}
+	else if ((B.array() != 0).count() < sparse_ratio * n * p)
+	{
+		type = basis_sparse;
+		S = B.sparseView();
+		S.makeCompressed();
+	}
+	else
+	{
+		type = basis_dense;
+		D = B;
+	}
+}
+
+VectorXd Basis::times(const VectorXd &theta) const
+{
+	if (type == basis_constant)
+		return VectorXd::Constant(n, c * theta(0));
+	else if (type == basis_sparse)
+		return S * theta;
+	return D * theta;
+}
+
+VectorXd Basis::t_times(const VectorXd &v) const
+{
+	if (type == basis_constant)
+		return VectorXd::Constant(1, c * v.sum());
+	else if (type == basis_sparse)
+		return S.transpose() * v;
+	return D.transpose() * v;
+}
@@ -0,0 +1,98 @@
+#include "../include/ellmatrix.h"
+#include <algorithm>
+
+bool ELLMatrix::compress(const SparseMatrix<double> &A, int max_k)
+{
+	SparseMatrix<double, Eigen::RowMajor> Ar = A;
+	Ar.makeCompressed();
+	const int *outer = Ar.outerIndexPtr();
+
+	int kmax = 0;
+	for (int i = 0; i < Ar.rows(); i++)
+		kmax = std::max(kmax, outer[i + 1] - outer[i]);
+	if (kmax > max_k || Ar.cols() == 0)
+		return false;
+
+	nrow = Ar.rows();
+	ncol = Ar.cols();
+	k = std::max(kmax, 1);
+	col.assign(nrow * k, 0);
+	val.assign(nrow * k, 0.0);
+	for (int i = 0; i < nrow; i++)
+	{
+		int nnz = outer[i + 1] - outer[i];
+		for (int j = 0; j < k; j++)
+		{
+			// padding repeats the first column of the row with weight 0
+			int p = outer[i] + (j < nnz ? j : 0);
+			col[i * k + j] = nnz > 0 ? Ar.innerIndexPtr()[p] : 0;
+			val[i * k + j] = j < nnz ? Ar.valuePtr()[p] : 0.0;
+		}
+	}
+	gram_pos.clear();
+	return true;
+}
+
+VectorXd ELLMatrix::times(const VectorXd &x) const
+{
+	VectorXd y(nrow);
+	for (int i = 0; i < nrow; i++)
+	{
+		double s = 0;
+		for (int j = 0; j < k; j++)
+			s += val[i * k + j] * x(col[i * k + j]);
+		y(i) = s;
+	}
+	return y;
+}
+
+VectorXd ELLMatrix::t_times(const VectorXd &y) const
+{
+	VectorXd x = VectorXd::Zero(ncol);
+	for (int i = 0; i < nrow; i++)
+		for (int j = 0; j < k; j++)
+			x(col[i * k + j]) += val[i * k + j] * y(i);
+	return x;
+}
+
+void ELLMatrix::gram_pattern(SparseMatrix<double> &G)
+{
+	std::vector<Eigen::Triplet<double>> trip;
+	trip.reserve(nrow * k * k);
+	for (int i = 0; i < nrow; i++)
+		for (int a = 0; a < k; a++)
+			for (int b = 0; b < k; b++)
+				trip.push_back(Eigen::Triplet<double>(col[i * k + a], col[i * k + b], 0.0));
+	G.resize(ncol, ncol);
+	G.setFromTriplets(trip.begin(), trip.end());
+	G.makeCompressed();
+
+	// position of each (row, a, b) product in the value array
+	gram_pos.resize(nrow * k * k);
+	const int *outer = G.outerIndexPtr();
+	const int *inner = G.innerIndexPtr();
+	for (int i = 0; i < nrow; i++)
+		for (int a = 0; a < k; a++)
+			for (int b = 0; b < k; b++)
+			{
+				int r = col[i * k + a], c = col[i * k + b];
+				gram_pos[(i * k + a) * k + b] = std::lower_bound(inner + outer[c], inner + outer[c + 1], r) - inner;
+			}
+}
+
+void ELLMatrix::weighted_gram(const VectorXd &w, SparseMatrix<double> &G) const
+{
+	double *values = G.valuePtr();
+	std::fill(values, values + G.nonZeros(), 0.0);
+	for (int i = 0; i < nrow; i++)
+	{
+		const double *v = &val[i * k];
+		const int *pos = &gram_pos[i * k * k];
+		for (int a = 0; a < k; a++)
+		{
+			double wa = w(i) * v[a];
+			for (int b = 0; b < k; b++)
+				values[pos[a * k + b]] += wa * v[b];
+		}
+	}
+}
@@ -0,0 +1,233 @@
+#include "../include/model_file.h"
+#include <fstream>
+#include <climits>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// ---- writer ----
+
+void ModelFileWriter::add_entry(const std::string &name, Model_entry_type type, int64_t rows, int64_t cols, const void *p, size_t bytes)
+{
+	payload.resize((payload.size() + 7) / 8 * 8, '\0');
+	ModelEntry e;
+	e.type = type;
+	e.rows = rows;
+	e.cols = cols;
+	e.offset = payload.size(); // relative to the payload, fixed up in release
+	e.bytes = bytes;
+	if (bytes > 0)
+		payload.append(static_cast<const char *>(p), bytes);
+	toc.push_back(std::make_pair(name, e));
+}
+
+void ModelFileWriter::add(const std::string &name, const Eigen::SparseMatrix<double, 0, int> &M)
+{
+	Eigen::SparseMatrix<double, 0, int> C = M;
+	C.makeCompressed();
+	add_entry(name, entry_sparse, C.rows(), C.cols(), nullptr, 0);
+	add_entry(name + "/outer", entry_int, C.cols() + 1, 1, C.outerIndexPtr(), sizeof(int) * (C.cols() + 1));
+	add_entry(name + "/inner", entry_int, C.nonZeros(), 1, C.innerIndexPtr(), sizeof(int) * C.nonZeros());
+	add_entry(name + "/values", entry_double, C.nonZeros(), 1, C.valuePtr(), sizeof(double) * C.nonZeros());
+}
+
+std::string ModelFileWriter::release()
+{
+	const uint64_t header_size = 32;
+	payload.resize((payload.size() + 7) / 8 * 8, '\0');
+
+	BinaryWriter out;
+	out.write_raw(MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC));
+	out.write(MODEL_FILE_VERSION);
+	out.write(MODEL_FILE_BOM);
+	out.write<uint64_t>(toc.size());
+	out.write<uint64_t>(header_size + payload.size());
+	out.write_raw(payload.data(), payload.size());
+	for (std::pair<std::string, ModelEntry> &it : toc)
+	{
+		out.write(it.first);
+		out.write(it.second.type);
+		out.write(it.second.rows);
+		out.write(it.second.cols);
+		out.write<uint64_t>(header_size + it.second.offset);
+		out.write(it.second.bytes);
+	}
+	payload.clear();
+	toc.clear();
+	return out.release();
+}
+
+// ---- mapping ----
+
+bool MappedFile::open(const std::string &path)
+{
+	close();
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	n = st.st_size;
+	if (n > 0)
+	{
+		void *m = mmap(nullptr, n, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED)
+		{
+			p = static_cast<const char *>(m);
+			mapped = true;
+		}
+	}
+	::close(fd);
+	if (mapped || n == 0)
+		return true;
+#endif
+	if (!read_file(path, buf))
+		return false;
+	p = buf.data();
+	n = buf.size();
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+	if (mapped)
+		munmap(const_cast<char *>(p), n);
+#endif
+	mapped = false;
+	p = nullptr;
+	n = 0;
+	buf.clear();
+}
+
+// ---- reader ----
+
+ModelFile::ModelFile(const std::string &path)
+{
+	if (!file.open(path))
+		throw("can not open the model file");
+	if (file.size() < 32 || std::memcmp(file.data(), MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC)) != 0)
+		throw("not an ngme model file");
+
+	const char *p = file.data() + sizeof(MODEL_FILE_MAGIC);
+	uint32_t bom;
+	uint64_t n_entries, toc_offset;
+	std::memcpy(&version, p, 4);
+	std::memcpy(&bom, p + 4, 4);
+	std::memcpy(&n_entries, p + 8, 8);
+	std::memcpy(&toc_offset, p + 16, 8);
+	if (bom != MODEL_FILE_BOM)
+		throw("the model file was written with a different byte order");
+	if (version > MODEL_FILE_VERSION)
+		throw("the model file was written by a newer version of ngme2");
+	if (toc_offset < 32 || toc_offset > file.size())
+		throw("the model file is truncated");
+
+	// the toc is small, parse it from a copy
+	std::string toc_buf(file.data() + toc_offset, file.size() - toc_offset);
+	BinaryReader in(toc_buf);
+	for (uint64_t i = 0; i < n_entries; i++)
+	{
+		std::string name;
+		ModelEntry e;
+		in.read(name);
+		in.read(e.type);
+		in.read(e.rows);
+		in.read(e.cols);
+		in.read(e.offset);
+		in.read(e.bytes);
+		if (e.offset > toc_offset || e.bytes > toc_offset - e.offset)
+			throw("the model file is truncated");
+		toc[name] = e;
+	}
+}
+
+// rows * cols elements of the type, inside the payload and aligned for the views
+const ModelEntry &ModelFile::entry(const std::string &name, Model_entry_type type) const
+{
+	std::map<std::string, ModelEntry>::const_iterator it = toc.find(name);
+	if (it == toc.end() || it->second.type != (uint32_t)type)
+		throw("entry is missing in the model file");
+	const ModelEntry &e = it->second;
+
+	if (e.rows < 0 || e.cols < 0 || e.offset % 8 != 0 || e.offset > file.size() || e.bytes > file.size() - e.offset)
+		throw("malformed entry in the model file");
+	if (type == entry_sparse)
+		return e;
+	uint64_t size = type == entry_double ? sizeof(double) : type == entry_int ? sizeof(int) : 1;
+	bool fits = (e.rows == 0 || e.cols == 0)
+		? e.bytes == 0
+		: (uint64_t)e.rows <= e.bytes / size / (uint64_t)e.cols && (uint64_t)e.rows * e.cols * size == e.bytes;
+	if (!fits)
+		throw("malformed entry in the model file");
+	return e;
+}
+
+std::vector<std::string> ModelFile::names() const
+{
+	std::vector<std::string> ret;
+	for (const std::pair<const std::string, ModelEntry> &it : toc)
+		ret.push_back(it.first);
+	return ret;
+}
+
+Eigen::Map<const Eigen::MatrixXd> ModelFile::matrix(const std::string &name) const
+{
+	const ModelEntry &e = entry(name, entry_double);
+	return Eigen::Map<const Eigen::MatrixXd>(reinterpret_cast<const double *>(file.data() + e.offset), e.rows, e.cols);
+}
+
+Eigen::Map<const Eigen::VectorXd> ModelFile::vector(const std::string &name) const
+{
+	const ModelEntry &e = entry(name, entry_double);
+	return Eigen::Map<const Eigen::VectorXd>(reinterpret_cast<const double *>(file.data() + e.offset), e.rows * e.cols);
+}
+
+Eigen::Map<const Eigen::VectorXi> ModelFile::ivector(const std::string &name) const
+{
+	const ModelEntry &e = entry(name, entry_int);
+	return Eigen::Map<const Eigen::VectorXi>(reinterpret_cast<const int *>(file.data() + e.offset), e.rows * e.cols);
+}
+
+// the compressed column arrays must describe a valid rows * cols matrix
+Eigen::Map<const Eigen::SparseMatrix<double, 0, int>> ModelFile::sparse(const std::string &name) const
+{
+	const ModelEntry &e = entry(name, entry_sparse);
+	const ModelEntry &outer = entry(name + "/outer", entry_int);
+	const ModelEntry &inner = entry(name + "/inner", entry_int);
+	const ModelEntry &values = entry(name + "/values", entry_double);
+	if (e.rows > INT_MAX || e.cols >= INT_MAX || outer.rows * outer.cols != e.cols + 1 ||
+		inner.rows * inner.cols != values.rows * values.cols || inner.rows * inner.cols > INT_MAX)
+		throw("malformed sparse matrix in the model file");
+
+	const int *p = reinterpret_cast<const int *>(file.data() + outer.offset);
+	const int *i = reinterpret_cast<const int *>(file.data() + inner.offset);
+	const int nnz = inner.rows * inner.cols;
+	if (p[0] != 0 || p[e.cols] != nnz)
+		throw("malformed sparse matrix in the model file");
+	for (int64_t j = 0; j < e.cols; j++)
+		if (p[j] > p[j + 1])
+			throw("malformed sparse matrix in the model file");
+	for (int k = 0; k < nnz; k++)
+		if (i[k] < 0 || i[k] >= e.rows)
+			throw("malformed sparse matrix in the model file");
+
+	return Eigen::Map<const Eigen::SparseMatrix<double, 0, int>>(
+		e.rows, e.cols, nnz, p, i,
+		reinterpret_cast<const double *>(file.data() + values.offset));
+}
+
+std::string ModelFile::string(const std::string &name) const
+{
+	const ModelEntry &e = entry(name, entry_string);
+	return std::string(file.data() + e.offset, e.bytes);
+}
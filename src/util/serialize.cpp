@@ -0,0 +1,89 @@
+#include "../include/serialize.h"
+#include <fstream>
+#include <cstdio>
+
+bool read_file(const std::string &path, std::string &buf)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return false;
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	buf = ss.str();
+	return true;
+}
+
+AsyncFileWriter::AsyncFileWriter(const std::string &path_)
+	: path(path_), has_pending(false), stop(false)
+{
+	worker = std::thread(&AsyncFileWriter::run, this);
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+	close();
+}
+
+void AsyncFileWriter::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m);
+		stop = true;
+	}
+	cv.notify_one();
+	if (worker.joinable())
+		worker.join();
+}
+
+std::string AsyncFileWriter::take_error()
+{
+	std::lock_guard<std::mutex> lock(m);
+	std::string ret;
+	ret.swap(error);
+	return ret;
+}
+
+void AsyncFileWriter::submit(std::string &&buf)
+{
+	{
+		std::lock_guard<std::mutex> lock(m);
+		pending = std::move(buf);
+		has_pending = true;
+	}
+	cv.notify_one();
+}
+
+void AsyncFileWriter::run()
+{
+	while (true)
+	{
+		std::string buf;
+		{
+			std::unique_lock<std::mutex> lock(m);
+			cv.wait(lock, [this] { return has_pending || stop; });
+			if (!has_pending)
+				return;
+			buf = std::move(pending);
+			has_pending = false;
+		}
+
+		std::string tmp = path + ".tmp";
+		bool ok;
+		{
+			std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+			out.write(buf.data(), buf.size());
+			out.close();
+			ok = !out.fail();
+		}
+		const char *msg = ok ? nullptr : "can not write ";
+		if (ok && std::rename(tmp.c_str(), path.c_str()) != 0)
+			msg = "can not replace ";
+		if (msg)
+		{
+			std::remove(tmp.c_str());
+			std::lock_guard<std::mutex> lock(m);
+			if (error.empty())
+				error = msg + path;
+		}
+	}
+}
@@ -1,4 +1,6 @@
 #include "../include/solver.h"
+#include <algorithm>
+#include <vector>
 using namespace Eigen;
 double myround(double x)
 {
@@ -51,21 +53,89 @@ void iterative_solver::init(int nin, int Nin, int max_iter, double tol)
 
 void iterative_solver::compute(SparseMatrix<double, 0, int> &M)
 {
+  Q = M;
   R.factorize(M);
   // U.setRandom(n,N);
   // U = U.unaryExpr(std::ptr_fun(myround));
   QU_computed = 0;
 }
 
+// preconditioned CG for each column, the recurrences are per column but
+// the columns share the products with Q and the AMG V-cycle
+MatrixXd iterative_solver::solve_block(const MatrixXd &B, const MatrixXd &X0)
+{
+  const int k = B.cols();
+  const double tol = R.tolerance();
+  const AMGPreconditioner &P = R.preconditioner();
+
+  MatrixXd X = X0;
+  // working columns (compacted as columns converge), idx maps them back to B
+  std::vector<int> idx(k);
+  for (int j = 0; j < k; j++)
+    idx[j] = j;
+  MatrixXd Xa = X0;
+  MatrixXd Ra = B - Q * X0;
+  MatrixXd Za = P.solve(Ra);
+  MatrixXd Pa = Za;
+  VectorXd rz = Ra.cwiseProduct(Za).colwise().sum().transpose();
+  VectorXd bnorm2 = B.colwise().squaredNorm().transpose();
+
+  for (int iter = 0; iter < R.maxIterations(); iter++)
+  {
+    // deflation: move converged columns out of the working set
+    for (int j = (int)idx.size() - 1; j >= 0; j--)
+    {
+      if (Ra.col(j).squaredNorm() > tol * tol * bnorm2(idx[j]))
+        continue;
+      X.col(idx[j]) = Xa.col(j);
+      int last = idx.size() - 1;
+      if (j != last)
+      {
+        Xa.col(j) = Xa.col(last);
+        Ra.col(j) = Ra.col(last);
+        Pa.col(j) = Pa.col(last);
+        rz(j) = rz(last);
+        idx[j] = idx[last];
+      }
+      idx.pop_back();
+      Xa.conservativeResize(NoChange, last);
+      Ra.conservativeResize(NoChange, last);
+      Pa.conservativeResize(NoChange, last);
+      rz.conservativeResize(last);
+    }
+    if (idx.empty())
+      break;
+
+    MatrixXd APa = Q * Pa;
+    VectorXd pAp = Pa.cwiseProduct(APa).colwise().sum().transpose();
+    for (int j = 0; j < (int)idx.size(); j++)
+    {
+      double alpha = rz(j) / pAp(j);
+      Xa.col(j) += alpha * Pa.col(j);
+      Ra.col(j) -= alpha * APa.col(j);
+    }
+
+    Za = P.solve(Ra);
+    for (int j = 0; j < (int)idx.size(); j++)
+    {
+      double rz_new = Ra.col(j).dot(Za.col(j));
+      Pa.col(j) = Za.col(j) + (rz_new / rz(j)) * Pa.col(j);
+      rz(j) = rz_new;
+    }
+  }
+
+  // not converged within max iterations
+  for (int j = 0; j < (int)idx.size(); j++)
+    X.col(idx[j]) = Xa.col(j);
+  return X;
+}
+
 // Solve trace(M*Q^-1)
 double iterative_solver::trace(MatrixXd &M)
 {
   if (QU_computed == 0)
   {
-    for (int i = 0; i < N; i++)
-    {
-      QU.col(i) = R.solveWithGuess(U.col(i), QU.col(i));
-    }
+    QU = solve_block(U, QU);
     QU_computed = 1;
   }
 
@@ -85,10 +155,7 @@ double iterative_solver::trace(SparseMatrix<double, 0, int> &M)
 
   if (QU_computed == 0)
   {
-    for (int i = 0; i < N; i++)
-    {
-      QU.col(i) = R.solveWithGuess(U.col(i), QU.col(i));
-    }
+    QU = solve_block(U, QU);
     QU_computed = 1;
   }
   MQU = M * QU;
@@ -106,18 +173,12 @@ double iterative_solver::trace2(SparseMatrix<double, 0, int> &M1, SparseMatrix<d
 
   if (QU_computed == 0)
   {
-    for (int i = 0; i < N; i++)
-    {
-      QU.col(i) = R.solveWithGuess(U.col(i), QU.col(i));
-    }
+    QU = solve_block(U, QU);
     QU_computed = 1;
   }
   MU = M2.transpose() * U;
   MQU = M1 * QU;
-  for (int i = 0; i < N; i++)
-  {
-    MU.col(i) = R.solveWithGuess(MU.col(i), MU.col(i));
-  }
+  MU = solve_block(MU, MU);
   double t = 0;
   for (int i = 0; i < N; i++)
   {
@@ -251,6 +312,63 @@ Eigen::VectorXd cholesky_solver::Qinv_diag()
   return R.permutationPinv() * vars;
 }
 
+// var(b^T x) = sum_jk b_j b_k Qinv_jk is read from the selected inverse when it has all the
+// pairs of the support of b (e.g. rows of a barycentric observation matrix), other rows are
+// computed as |L^-1 P b|^2 in batches of batch_size rows
+Eigen::VectorXd cholesky_solver::Qinv_diag(const SparseMatrix<double, Eigen::RowMajor> &B, int batch_size)
+{
+  const int n_rows = B.rows();
+  VectorXd vars(n_rows);
+
+  const SparseMatrix<double, 0, int> Sigma = return_Qinv();
+  std::vector<char> found_all(n_rows, 0);
+#pragma omp parallel for schedule(dynamic, 256)
+  for (int r = 0; r < n_rows; r++)
+  {
+    std::vector<int> cols;
+    std::vector<double> vals;
+    for (SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(B, r); it; ++it)
+    {
+      cols.push_back(it.col());
+      vals.push_back(it.value());
+    }
+    double v = 0;
+    size_t n_found = 0;
+    for (size_t j = 0; j < cols.size(); j++)
+    {
+      for (SparseMatrix<double, 0, int>::InnerIterator it(Sigma, cols[j]); it; ++it)
+      {
+        std::vector<int>::iterator k = std::find(cols.begin(), cols.end(), it.row());
+        if (k == cols.end())
+          continue;
+        v += vals[j] * vals[k - cols.begin()] * it.value();
+        n_found++;
+      }
+    }
+    vars(r) = v;
+    found_all[r] = (n_found == cols.size() * cols.size());
+  }
+
+  std::vector<int> rest;
+  for (int r = 0; r < n_rows; r++)
+    if (!found_all[r])
+      rest.push_back(r);
+
+  batch_size = std::max(batch_size, 1);
+  for (size_t start = 0; start < rest.size(); start += batch_size)
+  {
+    int b = std::min((size_t)batch_size, rest.size() - start);
+    MatrixXd Bt = MatrixXd::Zero(B.cols(), b);
+    for (int j = 0; j < b; j++)
+      for (SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(B, rest[start + j]); it; ++it)
+        Bt(it.col(), j) = it.value();
+    VectorXd v = solve_L(Bt).colwise().squaredNorm();
+    for (int j = 0; j < b; j++)
+      vars(rest[start + j]) = v(j);
+  }
+  return vars;
+}
+
 /* --------------------------------------------------------- */
 /* --------------------------------------------------------- */
 // LU SOLVER
@@ -415,7 +533,7 @@ double lu_sparse_solver::trace2(SparseMatrix<double, 0, int> &M1, SparseMatrix<d
   return 0;
 }
 
-inline double lu_sparse_solver::logdet()
+double lu_sparse_solver::logdet()
 {
   SparseMatrix<double, 0, int> R_Q = L_KKt.matrixL();
   return R_Q.diagonal().array().log().sum();
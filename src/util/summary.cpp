@@ -0,0 +1,237 @@
+#include "../include/summary.h"
+#include <algorithm>
+
+void PosteriorSummary::init(int n_, const VectorXd &probs_, const VectorXd &thresholds_)
+{
+	n = n_;
+	n_draws = 0;
+	probs = probs_;
+	thresholds = thresholds_;
+	mu = VectorXd::Zero(n);
+	M2 = VectorXd::Zero(n);
+	exceed = Eigen::MatrixXi::Zero(n, thresholds.size());
+
+	q.assign((size_t)probs.size() * n * 5, 0.0);
+	pos.assign((size_t)probs.size() * n * 5, 0);
+	desired.resize(probs.size() * 5);
+	for (int k = 0; k < probs.size(); k++)
+	{
+		double p = probs(k);
+		double *D = &desired[k * 5];
+		D[0] = 1;
+		D[1] = 1 + 2 * p;
+		D[2] = 1 + 4 * p;
+		D[3] = 3 + 2 * p;
+		D[4] = 5;
+	}
+}
+
+void PosteriorSummary::add(const VectorXd &x)
+{
+	n_draws++;
+
+	// Welford
+	VectorXd delta = x - mu;
+	mu += delta / n_draws;
+	M2.array() += delta.array() * (x - mu).array();
+
+	for (int t = 0; t < thresholds.size(); t++)
+		exceed.col(t).array() += (x.array() > thresholds(t)).cast<int>();
+
+	add_quantiles(x);
+}
+
+void PosteriorSummary::add_quantiles(const VectorXd &x)
+{
+	for (int k = 0; k < probs.size(); k++)
+	{
+		double *Q = &q[(size_t)k * n * 5];
+		if (n_draws <= 5)
+		{
+			// the first 5 draws are the initial markers
+			for (int i = 0; i < n; i++)
+				Q[(size_t)i * 5 + n_draws - 1] = x(i);
+			if (n_draws == 5)
+			{
+				int *N = &pos[(size_t)k * n * 5];
+				for (int i = 0; i < n; i++)
+				{
+					std::sort(Q + (size_t)i * 5, Q + (size_t)i * 5 + 5);
+					for (int j = 0; j < 5; j++)
+						N[(size_t)i * 5 + j] = j + 1;
+				}
+			}
+			continue;
+		}
+
+		double p = probs(k);
+		double *D = &desired[k * 5];
+		D[1] += p / 2;
+		D[2] += p;
+		D[3] += (1 + p) / 2;
+		D[4] += 1;
+		for (int i = 0; i < n; i++)
+			add_quantile(k, i, x(i));
+	}
+}
+
+void PosteriorSummary::add_quantile(int k, int i, double x)
+{
+	double *Q = &q[((size_t)k * n + i) * 5];
+	int *N = &pos[((size_t)k * n + i) * 5];
+	const double *D = &desired[k * 5];
+
+	// cell of x, extend the extreme markers
+	int c = 0;
+	if (x < Q[0])
+		Q[0] = x;
+	else if (x >= Q[4])
+	{
+		Q[4] = x;
+		c = 3;
+	}
+	else
+		while (x >= Q[c + 1])
+			c++;
+	for (int j = c + 1; j < 5; j++)
+		N[j]++;
+
+	// move the middle markers towards their desired positions
+	for (int j = 1; j < 4; j++)
+	{
+		double d = D[j] - N[j];
+		if ((d >= 1 && N[j + 1] - N[j] > 1) || (d <= -1 && N[j - 1] - N[j] < -1))
+		{
+			int s = d > 0 ? 1 : -1;
+			// piecewise parabolic prediction, linear if it is not monotone
+			double qp = Q[j] + (double)s / (N[j + 1] - N[j - 1]) *
+				((N[j] - N[j - 1] + s) * (Q[j + 1] - Q[j]) / (N[j + 1] - N[j]) +
+				 (N[j + 1] - N[j] - s) * (Q[j] - Q[j - 1]) / (N[j] - N[j - 1]));
+			if (!(Q[j - 1] < qp && qp < Q[j + 1]))
+				qp = Q[j] + s * (Q[j + s] - Q[j]) / (N[j + s] - N[j]);
+			Q[j] = qp;
+			N[j] += s;
+		}
+	}
+}
+
+VectorXd PosteriorSummary::raw_draw(int r) const
+{
+	VectorXd x(n);
+	for (int i = 0; i < n; i++)
+		x(i) = q[(size_t)i * 5 + r];
+	return x;
+}
+
+void PosteriorSummary::merge(const PosteriorSummary &o)
+{
+	if (o.n != n || o.probs.size() != probs.size() || o.probs != probs ||
+		o.thresholds.size() != thresholds.size() || o.thresholds != thresholds)
+		throw("can not merge summaries of different quantities");
+	if (o.n_draws == 0)
+		return;
+	const int n_total = n_draws + o.n_draws;
+
+	if (probs.size() > 0)
+	{
+		if (o.n_draws < 5)
+		{
+			// replay the few draws of o
+			int n0 = n_draws;
+			for (int r = 0; r < o.n_draws; r++)
+			{
+				n_draws = n0 + r + 1;
+				add_quantiles(o.raw_draw(r));
+			}
+			n_draws = n0;
+		}
+		else if (n_draws < 5)
+		{
+			PosteriorSummary tmp = o;
+			for (int r = 0; r < n_draws; r++)
+			{
+				tmp.n_draws = o.n_draws + r + 1;
+				tmp.add_quantiles(raw_draw(r));
+			}
+			q.swap(tmp.q);
+			pos.swap(tmp.pos);
+			desired.swap(tmp.desired);
+		}
+		else
+		{
+			double wa = (double)n_draws / n_total, wb = (double)o.n_draws / n_total;
+			for (size_t m = 0; m < q.size(); m += 5)
+			{
+				q[m] = std::min(q[m], o.q[m]);
+				q[m + 4] = std::max(q[m + 4], o.q[m + 4]);
+				for (int j = 1; j < 4; j++)
+				{
+					q[m + j] = wa * q[m + j] + wb * o.q[m + j];
+					pos[m + j] += o.pos[m + j] - 1;
+				}
+				pos[m + 4] = n_total;
+			}
+			// desired positions after n_total draws
+			for (int k = 0; k < probs.size(); k++)
+			{
+				double p = probs(k);
+				double *D = &desired[k * 5];
+				D[1] = 1 + (n_total - 1) * p / 2;
+				D[2] = 1 + (n_total - 1) * p;
+				D[3] = 1 + (n_total - 1) * (1 + p) / 2;
+				D[4] = n_total;
+			}
+		}
+	}
+
+	// Chan et al. pairwise update
+	VectorXd delta = o.mu - mu;
+	mu += delta * ((double)o.n_draws / n_total);
+	M2 += o.M2 + delta.cwiseAbs2() * ((double)n_draws * o.n_draws / n_total);
+	exceed += o.exceed;
+	n_draws = n_total;
+}
+
+VectorXd PosteriorSummary::variance() const
+{
+	if (n_draws < 2)
+		return VectorXd::Zero(n);
+	return M2 / (n_draws - 1);
+}
+
+MatrixXd PosteriorSummary::quantiles() const
+{
+	MatrixXd ret(n, probs.size());
+	for (int k = 0; k < probs.size(); k++)
+	{
+		const double *Q = &q[(size_t)k * n * 5];
+		for (int i = 0; i < n; i++)
+		{
+			if (n_draws > 5)
+			{
+				ret(i, k) = Q[(size_t)i * 5 + 2];
+				continue;
+			}
+			if (n_draws == 0)
+			{
+				ret(i, k) = 0;
+				continue;
+			}
+			// the markers are still the draws themselves, interpolate them
+			std::vector<double> s(Q + (size_t)i * 5, Q + (size_t)i * 5 + n_draws);
+			std::sort(s.begin(), s.end());
+			double h = probs(k) * (n_draws - 1);
+			int lo = (int)h;
+			int hi = std::min(lo + 1, n_draws - 1);
+			ret(i, k) = s[lo] + (h - lo) * (s[hi] - s[lo]);
+		}
+	}
+	return ret;
+}
+
+MatrixXd PosteriorSummary::exceedance() const
+{
+	if (n_draws == 0)
+		return MatrixXd::Zero(n, thresholds.size());
+	return exceed.cast<double>() / n_draws;
+}
@@ -0,0 +1,138 @@
+#include "../include/trajectory.h"
+#include <algorithm>
+
+void Trajectory::init(int n_col_, int n_expected, int thin_, bool single_, const std::string &file_, bool append)
+{
+	n_col = n_col_;
+	thin = std::max(thin_, 1);
+	single = single_;
+	file = file_;
+	streaming = !file.empty();
+	n_calls = 0;
+	n_rows = 0;
+
+	data_d.clear();
+	data_f.clear();
+	if (streaming)
+	{
+		capacity = 0;
+		row_d.assign(single ? 0 : n_col, 0.0);
+		row_f.assign(single ? n_col : 0, 0.0f);
+		if (sink.is_open())
+			sink.close();
+		sink.open(file, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+	}
+	else
+	{
+		capacity = std::max((n_expected + thin - 1) / thin, 1);
+		if (single) data_f.resize((size_t)capacity * n_col);
+		else data_d.resize((size_t)capacity * n_col);
+	}
+}
+
+// more rows than expected, double the capacity and move the columns
+void Trajectory::grow()
+{
+	int new_capacity = std::max(2 * capacity, 1);
+	if (single)
+	{
+		std::vector<float> tmp((size_t)new_capacity * n_col);
+		for (int j = 0; j < n_col; j++)
+			std::copy_n(data_f.begin() + (size_t)j * capacity, n_rows, tmp.begin() + (size_t)j * new_capacity);
+		data_f.swap(tmp);
+	}
+	else
+	{
+		std::vector<double> tmp((size_t)new_capacity * n_col);
+		for (int j = 0; j < n_col; j++)
+			std::copy_n(data_d.begin() + (size_t)j * capacity, n_rows, tmp.begin() + (size_t)j * new_capacity);
+		data_d.swap(tmp);
+	}
+	capacity = new_capacity;
+}
+
+void Trajectory::end_row()
+{
+	if (streaming)
+	{
+		if (single) sink.write(reinterpret_cast<const char *>(row_f.data()), sizeof(float) * n_col);
+		else sink.write(reinterpret_cast<const char *>(row_d.data()), sizeof(double) * n_col);
+	}
+	n_rows++;
+}
+
+void Trajectory::copy_to(double *dst) const
+{
+	if (streaming) return;
+	for (int j = 0; j < n_col; j++)
+	{
+		if (single)
+			std::copy_n(data_f.begin() + (size_t)j * capacity, n_rows, dst + (size_t)j * n_rows);
+		else
+			std::copy_n(data_d.begin() + (size_t)j * capacity, n_rows, dst + (size_t)j * n_rows);
+	}
+}
+
+void Trajectory::save(BinaryWriter &out) const
+{
+	out.write(n_col);
+	out.write(thin);
+	out.write(n_calls);
+	out.write(n_rows);
+	out.write(single);
+	out.write(file);
+	if (streaming)
+		return;
+	// only the filled rows of every column
+	for (int j = 0; j < n_col; j++)
+	{
+		if (single)
+			out.write_raw(data_f.data() + (size_t)j * capacity, sizeof(float) * n_rows);
+		else
+			out.write_raw(data_d.data() + (size_t)j * capacity, sizeof(double) * n_rows);
+	}
+}
+
+void Trajectory::load(BinaryReader &in)
+{
+	int n_col_, thin_, n_calls_, n_rows_;
+	bool single_;
+	std::string file_;
+	in.read(n_col_);
+	in.read(thin_);
+	in.read(n_calls_);
+	in.read(n_rows_);
+	in.read(single_);
+	in.read(file_);
+
+	if (!file_.empty())
+	{
+		// keep the rows written up to the checkpoint
+		size_t row_bytes = (single_ ? sizeof(float) : sizeof(double)) * n_col_;
+		std::string old;
+		if (sink.is_open())
+			sink.close();
+		if (n_col_ < 0 || n_rows_ < 0 || !read_file(file_, old) || old.size() < row_bytes * n_rows_)
+			throw("the trajectory file has fewer rows than the checkpoint");
+		old.resize(row_bytes * n_rows_);
+		init(n_col_, 0, thin_, single_, file_);
+		sink.write(old.data(), old.size());
+	}
+	else
+	{
+		init(n_col_, std::max(capacity, n_rows_ * thin_), thin_, single_, "");
+		if (capacity < n_rows_)
+			capacity = n_rows_;
+		if (single) data_f.resize((size_t)capacity * n_col);
+		else data_d.resize((size_t)capacity * n_col);
+		for (int j = 0; j < n_col; j++)
+		{
+			if (single)
+				in.read_raw(data_f.data() + (size_t)j * capacity, sizeof(float) * n_rows_);
+			else
+				in.read_raw(data_d.data() + (size_t)j * capacity, sizeof(double) * n_rows_);
+		}
+	}
+	n_calls = n_calls_;
+	n_rows = n_rows_;
+}
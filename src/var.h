@@ -10,25 +10,43 @@
 #include <string>
 #include <cmath>
 #include "sample_rGIG.h"
+#include "include/GIG.h"
+#include "include/serialize.h"
 
 using Eigen::VectorXd;
 using Eigen::SparseMatrix;
 using std::string;
 
+enum Noise_type {
+    noise_normal, noise_nig
+};
+
+inline Noise_type to_noise_type(const string& name) {
+    if (name == "nig") return noise_nig;
+    if (name == "normal") return noise_normal;
+    Rcpp::stop("Unknown noise type: " + name);
+}
+
 class Var {
 private:
     std::mt19937 var_rng;
 
     string noise_type; // normal or nig
+    Noise_type type;   // parsed once, used in the sampling loop
     double nu;
 
     unsigned n;
     VectorXd V, prevV;
     bool fix_V, fix_theta_V;
+
+    // Rao-Blackwellization: use E[V|.] and E[1/V|.] instead of V in the gradients
+    bool rao_blackwell {false};
+    VectorXd EV, EiV;
 public:
     Var(const Rcpp::List& noise_list, unsigned long seed) :
         var_rng       (seed),
         noise_type    (Rcpp::as<string>  (noise_list["noise_type"])),
+        type          (to_noise_type(noise_type)),
         nu            (Rcpp::as<double>  (noise_list["theta_V"])),
         n             (Rcpp::as<int>     (noise_list["n_noise"])),
         V             (n),
@@ -36,12 +54,12 @@ public:
         fix_V         (Rcpp::as<bool>    (noise_list["fix_V"])),
         fix_theta_V   (Rcpp::as<bool>    (noise_list["fix_theta_V"]))
     {
-        if (noise_type == "normal") {
+        if (type == noise_normal) {
             V = VectorXd::Ones(n);
             prevV = VectorXd::Ones(n);
             fix_theta_V = true;
             fix_V = true;
-        } else if (noise_type == "nig") {
+        } else if (type == noise_nig) {
             if (noise_list["V"] != R_NilValue) {
                 V = Rcpp::as< VectorXd > (noise_list["V"]);
                 prevV = V;
@@ -50,47 +68,77 @@ public:
                 sample_V();
             }
         }
+        EV = V;
+        EiV = V.cwiseInverse();
     }
     ~Var() {}
 
     string get_noise_type() const {return noise_type;}
+    Noise_type get_type() const   {return type;}
     const VectorXd& getV()     const {return V;}
     const VectorXd& getPrevV() const {return prevV;}
 
     void setPrevV(const VectorXd& V) { if (!fix_V) prevV = V; }
 
     void sample_V() {
-        if (noise_type == "nig") {
+        if (type == noise_nig) {
             prevV = V;
-            VectorXd nu_vec = VectorXd::Constant(n, nu);
-            if (!fix_V) V = rGIG_cpp(VectorXd::Constant(n, -0.5), nu_vec, nu_vec, var_rng());
+            if (!fix_V) rGIG_fill(-0.5, nu, nu, VectorXd(), VectorXd(), V, var_rng());
         }
         // else doing nothing
     }
 
     void sample_cond_V(const VectorXd& a_inc_vec, const VectorXd& b_inc_vec) {
-        if (noise_type == "nig") {
+        if (type == noise_nig) {
             prevV = V;
-            VectorXd p_vec = VectorXd::Constant(n, -1);
-            VectorXd a_vec = VectorXd::Constant(n, nu) + a_inc_vec;
-            VectorXd b_vec = VectorXd::Constant(n, nu) + b_inc_vec;
-            if (!fix_V) V = rGIG_cpp(p_vec, a_vec, b_vec, var_rng());
+            if (!fix_V) rGIG_fill(-1, nu, nu, a_inc_vec, b_inc_vec, V, var_rng());
         }
         // else doing nothing
     }
 
+    // only meaningful when V is random
+    void set_rao_blackwell(bool rb) { rao_blackwell = rb && type == noise_nig && !fix_V; }
+    bool use_rao_blackwell() const  { return rao_blackwell; }
+
+    // conditional moments of the same GIG as in sample_cond_V
+    void compute_cond_moments(const VectorXd& a_inc_vec, const VectorXd& b_inc_vec) {
+        if (!rao_blackwell) return;
+        VectorXd p_vec = VectorXd::Constant(n, -1);
+        VectorXd a_vec = VectorXd::Constant(n, nu) + a_inc_vec;
+        VectorXd b_vec = VectorXd::Constant(n, nu) + b_inc_vec;
+        EV_EiV_GIG(p_vec, a_vec, b_vec, EV, EiV);
+    }
+
+    // V or E[V|.] (Rao-Blackwellized)
+    const VectorXd& getEV()  const { return rao_blackwell ? EV : V; }
+    VectorXd        getEiV() const { return rao_blackwell ? EiV : V.cwiseInverse(); }
+
     double get_theta_V() const {
         return nu;
     }
 
+    // checkpointing
+    void save(BinaryWriter& out) const {
+        out.write(nu);
+        out.write(V); out.write(prevV);
+        out.write(EV); out.write(EiV);
+        out.write(var_rng);
+    }
+    void load(BinaryReader& in) {
+        in.read(nu);
+        in.read(V); in.read(prevV);
+        in.read(EV); in.read(EiV);
+        in.read(var_rng);
+    }
+
     double get_unbound_theta_V() const {
-        if (noise_type == "nig")
+        if (type == noise_nig)
             return log(nu);
         else
             return 0;
     }
     void   set_theta_var(double theta) {
-        if (noise_type == "nig") nu = exp(theta);
+        if (type == noise_nig) nu = exp(theta);
         // else doing nothing
     }
 
@@ -98,13 +146,17 @@ public:
         if (fix_theta_V) return 0;
 
         double grad = 0;
-        if (noise_type == "nig") {
-            VectorXd tmp = VectorXd::Constant(n, 1+1/(2*nu))
-                - 0.5*V - VectorXd::Constant(n, 1).cwiseQuotient(2*V);
-            grad = tmp.mean();
-            VectorXd tmp2 = VectorXd::Constant(n, 1+1/(2*nu))
-                - 0.5*prevV - VectorXd::Constant(n, 1).cwiseQuotient(2*prevV);
-            double grad2 = tmp2.mean();
+        if (type == noise_nig && rao_blackwell) {
+            grad = 1+1/(2*nu) - 0.5*EV.mean() - 0.5*EiV.mean();
+            double hess = -0.5 * pow(nu, -2);
+
+            // prevV is replaced by the same conditional expectation
+            grad = grad / (hess * nu + grad);
+        } else if (type == noise_nig) {
+            // mean of 1 + 1/(2 nu) - V/2 - 1/(2V), one pass each
+            double c = 1+1/(2*nu);
+            grad = c - 0.5 * (V.array() + V.array().inverse()).mean();
+            double grad2 = c - 0.5 * (prevV.array() + prevV.array().inverse()).mean();
 
             double hess = -0.5 * pow(nu, -2);
 